@@ -1,9 +1,74 @@
-/* Example program of how to analyize ARM machine code */
+/* Static analysis of ARM machine code: disassembles a whole function,
+ * builds its control-flow graph, dominators and loop nest, and exports
+ * the block boundaries and loop headers for armemu to load */
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 
-int addsub_a(int a, int b);
+#include "functions.h"
 
+#define MAX_INSTS 1024
+#define MAX_BLOCKS 256
+#define MAX_LOOPS 64
+#define LR 14
+
+/* End of the program's code, from the linker */
+extern char etext[];
+
+/* Instruction classes, matching the counters in armemu */
+enum inst_class
+{
+    CLASS_DP,
+    CLASS_MUL,
+    CLASS_MEM,
+    CLASS_BRANCH,
+    CLASS_SIMD,
+    CLASS_OTHER,
+    NUM_CLASSES
+};
+
+char *class_names[] = {"dp", "mul", "memory", "branch", "simd/vfp", "other"};
+
+/* A basic block covers instructions [start, end] */
+struct block
+{
+    int start;
+    int end;
+    int succ[2];
+    int nsucc;
+};
+
+/* A natural loop, body[b] is set for the blocks in it */
+struct loop
+{
+    int header;
+    int depth;
+    int nblocks;
+    bool body[MAX_BLOCKS];
+};
+
+/* The analysis of one function */
+struct cfg
+{
+    unsigned int *code;
+    int ninsts;
+
+    bool leader[MAX_INSTS];
+    int block_of[MAX_INSTS];
+
+    struct block blocks[MAX_BLOCKS];
+    int nblocks;
+
+    /* dom[b][d] is set when d dominates b */
+    bool dom[MAX_BLOCKS][MAX_BLOCKS];
+
+    struct loop loops[MAX_LOOPS];
+    int nloops;
+
+    int mix[NUM_CLASSES];
+};
 
 int analyze_iw(unsigned int iw)
 {
@@ -29,26 +94,603 @@ int analyze_iw(unsigned int iw)
     printf("imm = %d\n", imm);
 }
 
-int main(int argc, char **argv)
+/*---------- Decoding ----------*/
+
+bool is_bx_inst(unsigned int iw)
+{
+    return ((iw >> 4) & 0x00FFFFFF) == 0b000100101111111111110001;
+}
+
+bool is_b_inst(unsigned int iw)
+{
+    return ((iw >> 25) & 0b111) == 5;
+}
+
+bool is_bl_inst(unsigned int iw)
+{
+    return is_b_inst(iw) && ((iw >> 24) & 0b1) == 1;
+}
+
+bool is_cond_inst(unsigned int iw)
+{
+    return (iw >> 28) != 0b1110;
+}
+
+/* Index of the instruction a branch at index i jumps to */
+int branch_target(unsigned int iw, int i)
+{
+    int offset = iw & 0xFFFFFF;
+
+    /* Sign extend the 24 bit word offset */
+    if((iw >> 23) & 0b1)
+    {
+        offset = offset - (1 << 24);
+    }
+
+    return i + 2 + offset;
+}
+
+/* Classify an instruction for the static mix. Branches, loads/stores
+ * and multiplies decode as in armemu, with two differences: NEON and VFP
+ * instructions get their own SIMD class, where armemu counts their loads
+ * and stores as memory and the rest as data processing, and any
+ * coprocessor 10/11 encoding in the 0xC-0xF space counts as VFP, where
+ * armemu only decodes VLDR/VSTR and the 0xE forms. */
+enum inst_class classify(unsigned int iw)
+{
+    unsigned int op = (iw >> 26) & 0b11;
+
+    if(is_bx_inst(iw) || is_b_inst(iw))
+    {
+        return CLASS_BRANCH;
+    }
+    if((iw >> 25) == 0b1111001 || (iw >> 24) == 0xF4
+       || (((iw >> 24) & 0xF) >= 0b1100 && ((iw >> 9) & 0b111) == 0b101))
+    {
+        return CLASS_SIMD;
+    }
+    if((iw & 0x0FF00FFF) == 0x01900F9F || (iw & 0x0FF00FF0) == 0x01800F90
+       || (iw & 0xFFFFFFF0) == 0xF57FF050 || op == 1)
+    {
+        return CLASS_MEM;
+    }
+    if(op == 0 && ((iw >> 4) & 0b1111) == 0b1001)
+    {
+        return CLASS_MUL;
+    }
+    if(op == 0)
+    {
+        return CLASS_DP;
+    }
+
+    return CLASS_OTHER;
+}
+
+char *cond_names[] = {"eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc",
+                      "hi", "ls", "ge", "lt", "gt", "le", "", ""};
+
+char *dp_names[] = {"and", "eor", "sub", "rsb", "add", "adc", "sbc", "rsc",
+                    "tst", "teq", "cmp", "cmn", "orr", "mov", "bic", "mvn"};
+
+/* Write a one line disassembly of the instruction at index i into buf */
+void disassemble(unsigned int iw, int i, char *buf)
+{
+    char *cond = cond_names[iw >> 28];
+    unsigned int opcode = (iw >> 21) & 0b1111;
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int rd = (iw >> 12) & 0xF;
+    unsigned int rm = iw & 0xF;
+    char op2[16];
+
+    if(((iw >> 25) & 0b1) == 1)
+    {
+        sprintf(op2, "#%d", iw & 0xFF);
+    }
+    else
+    {
+        sprintf(op2, "r%d", rm);
+    }
+
+    if(is_bx_inst(iw))
+    {
+        sprintf(buf, "bx%s r%d", cond, rm);
+    }
+    else if(is_b_inst(iw))
+    {
+        sprintf(buf, "b%s%s %d", is_bl_inst(iw) ? "l" : "", cond, branch_target(iw, i) * 4);
+    }
+    else if(classify(iw) == CLASS_SIMD)
+    {
+        sprintf(buf, "<simd/vfp>");
+    }
+    else if((iw & 0x0FF00FFF) == 0x01900F9F)
+    {
+        sprintf(buf, "ldrex%s r%d, [r%d]", cond, rd, rn);
+    }
+    else if((iw & 0x0FF00FF0) == 0x01800F90)
+    {
+        sprintf(buf, "strex%s r%d, r%d, [r%d]", cond, rd, rm, rn);
+    }
+    else if((iw & 0xFFFFFFF0) == 0xF57FF050)
+    {
+        sprintf(buf, "dmb");
+    }
+    else if(classify(iw) == CLASS_MUL)
+    {
+        sprintf(buf, "mul%s r%d, r%d, r%d", cond, rn, rm, (iw >> 8) & 0xF);
+    }
+    else if(classify(iw) == CLASS_MEM)
+    {
+        char offset[16];
+
+        if(((iw >> 25) & 0b1) == 1)
+        {
+            sprintf(offset, "r%d", rm);
+        }
+        else
+        {
+            sprintf(offset, "#%s%d", ((iw >> 23) & 0b1) ? "" : "-", iw & 0xFFF);
+        }
+        sprintf(buf, "%s%s%s r%d, [r%d, %s]", ((iw >> 20) & 0b1) ? "ldr" : "str",
+                ((iw >> 22) & 0b1) ? "b" : "", cond, rd, rn, offset);
+    }
+    else if(classify(iw) == CLASS_DP && opcode == 0b1101)
+    {
+        sprintf(buf, "mov%s r%d, %s", cond, rd, op2);
+    }
+    else if(classify(iw) == CLASS_DP && (opcode >> 2) == 0b10)
+    {
+        sprintf(buf, "%s%s r%d, %s", dp_names[opcode], cond, rn, op2);
+    }
+    else if(classify(iw) == CLASS_DP)
+    {
+        sprintf(buf, "%s%s r%d, r%d, %s", dp_names[opcode], cond, rd, rn, op2);
+    }
+    else
+    {
+        sprintf(buf, "<%08x>", iw);
+    }
+}
+
+/*---------- Control Flow ----------*/
+
+/* Most instructions the function at code can have: it ends before the
+ * next function in the table and before the end of the program text */
+int function_limit(unsigned int *code)
+{
+    unsigned int *end = (unsigned int *) etext;
+    unsigned int *addr;
+    int i;
+
+    for(i = 0; i < NUM_FUNCTIONS; i++)
+    {
+        addr = (unsigned int *) functions[i].addr;
+        if(addr > code && addr < end)
+        {
+            end = addr;
+        }
+    }
+
+    return end - code < MAX_INSTS ? end - code : MAX_INSTS;
+}
+
+/* Find the end of the function: the first bx lr that no branch inside
+ * the function jumps past, or the limit if there is none */
+int function_length(unsigned int *code)
+{
+    int i, target, furthest = 0;
+    int limit = function_limit(code);
+
+    for(i = 0; i < limit; i++)
+    {
+        if(is_b_inst(code[i]) && !is_bl_inst(code[i]))
+        {
+            target = branch_target(code[i], i);
+            if(target > furthest)
+            {
+                furthest = target;
+            }
+        }
+        if(is_bx_inst(code[i]) && (code[i] & 0xF) == LR && i >= furthest)
+        {
+            return i + 1;
+        }
+    }
+
+    return limit;
+}
+
+/* Split the function into basic blocks. Calls (bl) return to the next
+ * instruction, so they do not end a block. */
+void build_blocks(struct cfg *cfg)
 {
     unsigned int iw;
-    unsigned int *pc;
+    int i, b, target;
 
-    /* Get the address of the first instruction of the add assembly
-       function in memory. */
-    pc = (unsigned int *) addsub_a;
-    printf("pc = %X\n", (unsigned) pc);
-    
-    /* Get the 32 bit instruction work at the pc address. */
-    iw = *pc;
-    analyze_iw(iw);
+    for(i = 0; i < cfg->ninsts; i++)
+    {
+        cfg->leader[i] = (i == 0);
+    }
 
-    /* Move to next instruction */
-    pc = pc + 1;
-    printf("pc = %X\n", (unsigned) pc);
-    
-    iw = *pc;
-    analyze_iw(iw);
+    for(i = 0; i < cfg->ninsts; i++)
+    {
+        iw = cfg->code[i];
+        if(is_bx_inst(iw) || (is_b_inst(iw) && !is_bl_inst(iw)))
+        {
+            if(i + 1 < cfg->ninsts)
+            {
+                cfg->leader[i + 1] = true;
+            }
+            if(is_b_inst(iw))
+            {
+                target = branch_target(iw, i);
+                if(target >= 0 && target < cfg->ninsts)
+                {
+                    cfg->leader[target] = true;
+                }
+            }
+        }
+    }
+
+    cfg->nblocks = 0;
+    for(i = 0; i < cfg->ninsts; i++)
+    {
+        if(cfg->leader[i] && cfg->nblocks < MAX_BLOCKS)
+        {
+            cfg->blocks[cfg->nblocks].start = i;
+            cfg->nblocks++;
+        }
+        cfg->block_of[i] = cfg->nblocks - 1;
+        cfg->blocks[cfg->nblocks - 1].end = i;
+    }
+
+    /* Successor edges from the last instruction of each block */
+    for(b = 0; b < cfg->nblocks; b++)
+    {
+        struct block *blk = &cfg->blocks[b];
+        iw = cfg->code[blk->end];
+        blk->nsucc = 0;
+
+        if(is_bx_inst(iw))
+        {
+            continue;
+        }
+        if(is_b_inst(iw) && !is_bl_inst(iw))
+        {
+            target = branch_target(iw, blk->end);
+            if(target >= 0 && target < cfg->ninsts)
+            {
+                blk->succ[blk->nsucc++] = cfg->block_of[target];
+            }
+            if(!is_cond_inst(iw))
+            {
+                continue;
+            }
+        }
+        if(blk->end + 1 < cfg->ninsts)
+        {
+            blk->succ[blk->nsucc++] = b + 1;
+        }
+    }
+}
+
+/* Iterative dominator sets: dom(entry) = {entry}, dom(b) = {b} plus the
+ * intersection of dom(p) over the predecessors p of b */
+void build_dominators(struct cfg *cfg)
+{
+    bool changed = true;
+    bool tmp[MAX_BLOCKS];
+    bool has_pred;
+    int b, p, d, s;
+
+    for(b = 0; b < cfg->nblocks; b++)
+    {
+        for(d = 0; d < cfg->nblocks; d++)
+        {
+            cfg->dom[b][d] = (b != 0) || (d == 0);
+        }
+    }
+
+    while(changed)
+    {
+        changed = false;
+        for(b = 1; b < cfg->nblocks; b++)
+        {
+            has_pred = false;
+            for(d = 0; d < cfg->nblocks; d++)
+            {
+                tmp[d] = true;
+            }
+
+            for(p = 0; p < cfg->nblocks; p++)
+            {
+                for(s = 0; s < cfg->blocks[p].nsucc; s++)
+                {
+                    if(cfg->blocks[p].succ[s] == b)
+                    {
+                        has_pred = true;
+                        for(d = 0; d < cfg->nblocks; d++)
+                        {
+                            tmp[d] = tmp[d] && cfg->dom[p][d];
+                        }
+                    }
+                }
+            }
+
+            /* Unreachable blocks are only dominated by themselves */
+            for(d = 0; d < cfg->nblocks; d++)
+            {
+                bool v = (d == b) || (has_pred && tmp[d]);
+                if(v != cfg->dom[b][d])
+                {
+                    cfg->dom[b][d] = v;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+/* Add the blocks that reach b without passing through the loop header */
+void loop_add_block(struct cfg *cfg, struct loop *loop, int b)
+{
+    int p, s;
+
+    if(loop->body[b])
+    {
+        return;
+    }
+
+    loop->body[b] = true;
+    loop->nblocks++;
+
+    for(p = 0; p < cfg->nblocks; p++)
+    {
+        for(s = 0; s < cfg->blocks[p].nsucc; s++)
+        {
+            if(cfg->blocks[p].succ[s] == b)
+            {
+                loop_add_block(cfg, loop, p);
+            }
+        }
+    }
+}
+
+/* Each back edge b -> h, where h dominates b, forms a natural loop with
+ * header h. Loops sharing a header are merged. */
+void build_loops(struct cfg *cfg)
+{
+    struct loop *loop;
+    int b, s, h, l, k;
+
+    cfg->nloops = 0;
+
+    for(b = 0; b < cfg->nblocks; b++)
+    {
+        for(s = 0; s < cfg->blocks[b].nsucc; s++)
+        {
+            h = cfg->blocks[b].succ[s];
+            if(!cfg->dom[b][h])
+            {
+                continue;
+            }
+
+            for(l = 0; l < cfg->nloops && cfg->loops[l].header != h; l++)
+            {
+            }
+            if(l == cfg->nloops)
+            {
+                if(cfg->nloops == MAX_LOOPS)
+                {
+                    continue;
+                }
+                loop = &cfg->loops[cfg->nloops++];
+                loop->header = h;
+                loop->nblocks = 1;
+                memset(loop->body, 0, sizeof(loop->body));
+                loop->body[h] = true;
+            }
+            loop_add_block(cfg, &cfg->loops[l], b);
+        }
+    }
+
+    /* Nesting depth is the number of loops whose body holds the header */
+    for(l = 0; l < cfg->nloops; l++)
+    {
+        cfg->loops[l].depth = 0;
+        for(k = 0; k < cfg->nloops; k++)
+        {
+            if(cfg->loops[k].body[cfg->loops[l].header])
+            {
+                cfg->loops[l].depth++;
+            }
+        }
+    }
+}
+
+void analyze_function(struct cfg *cfg, unsigned int *code)
+{
+    int i;
+
+    cfg->code = code;
+    cfg->ninsts = function_length(code);
+
+    for(i = 0; i < NUM_CLASSES; i++)
+    {
+        cfg->mix[i] = 0;
+    }
+    for(i = 0; i < cfg->ninsts; i++)
+    {
+        cfg->mix[classify(code[i])]++;
+    }
+
+    build_blocks(cfg);
+    build_dominators(cfg);
+    build_loops(cfg);
+}
+
+/*---------- Output ----------*/
+
+void print_cfg(struct cfg *cfg)
+{
+    char buf[64];
+    int i, b, s, d, l;
+
+    printf("\nDisassembly:\n");
+    printf("-----------------------------------\n");
+    for(i = 0; i < cfg->ninsts; i++)
+    {
+        if(cfg->leader[i])
+        {
+            printf("B%d:\n", cfg->block_of[i]);
+        }
+        disassemble(cfg->code[i], i, buf);
+        printf("  %4d: %08X  %s\n", i * 4, cfg->code[i], buf);
+    }
+
+    printf("\nControl Flow Graph:\n");
+    printf("-----------------------------------\n");
+    for(b = 0; b < cfg->nblocks; b++)
+    {
+        printf("B%d [%d-%d] ->", b, cfg->blocks[b].start * 4, cfg->blocks[b].end * 4);
+        for(s = 0; s < cfg->blocks[b].nsucc; s++)
+        {
+            printf(" B%d", cfg->blocks[b].succ[s]);
+        }
+        if(cfg->blocks[b].nsucc == 0)
+        {
+            printf(" exit");
+        }
+        printf("   dominators:");
+        for(d = 0; d < cfg->nblocks; d++)
+        {
+            if(cfg->dom[b][d])
+            {
+                printf(" B%d", d);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\nLoops:\n");
+    printf("-----------------------------------\n");
+    for(l = 0; l < cfg->nloops; l++)
+    {
+        printf("Header B%d, depth %d, %d blocks:", cfg->loops[l].header, cfg->loops[l].depth,
+               cfg->loops[l].nblocks);
+        for(b = 0; b < cfg->nblocks; b++)
+        {
+            if(cfg->loops[l].body[b])
+            {
+                printf(" B%d", b);
+            }
+        }
+        printf("\n");
+    }
+    if(cfg->nloops == 0)
+    {
+        printf("None\n");
+    }
+
+    printf("\nStatic Instruction Mix:\n");
+    printf("-----------------------------------\n");
+    for(i = 0; i < NUM_CLASSES; i++)
+    {
+        if(cfg->mix[i] > 0)
+        {
+            printf("%s: %d (%.1f%%)\n", class_names[i], cfg->mix[i], (double) cfg->mix[i] / cfg->ninsts * 100);
+        }
+    }
+    printf("Total: %d\n", cfg->ninsts);
+}
+
+/* Write the block boundaries and loop headers as byte offsets from the
+ * start of the function, in the format armemu -b loads */
+int export_cfg(struct cfg *cfg, char *name, char *path)
+{
+    FILE *f = fopen(path, "w");
+    int b, l;
+
+    if(f == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(f, "function %s\n", name);
+    for(b = 0; b < cfg->nblocks; b++)
+    {
+        fprintf(f, "block %d %d\n", cfg->blocks[b].start * 4, cfg->blocks[b].end * 4);
+    }
+    for(l = 0; l < cfg->nloops; l++)
+    {
+        fprintf(f, "loop %d %d %d\n", cfg->blocks[cfg->loops[l].header].start * 4,
+                cfg->loops[l].depth, cfg->loops[l].nblocks);
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct cfg *cfg;
+    char *name = "addsub_a";
+    char *out = NULL;
+    unsigned int *pc = NULL;
+    int i;
+
+    /* Usage: analyze [function] [-o file.cfg] [-v] */
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            out = argv[++i];
+        }
+        else if(strcmp(argv[i], "-v") != 0)
+        {
+            name = argv[i];
+        }
+    }
+
+    for(i = 0; i < NUM_FUNCTIONS; i++)
+    {
+        if(strcmp(functions[i].name, name) == 0)
+        {
+            pc = (unsigned int *) functions[i].addr;
+        }
+    }
+    if(pc == NULL)
+    {
+        fprintf(stderr, "Unknown function %s\n", name);
+        return 1;
+    }
+
+    printf("function %s, pc = %X\n", name, (unsigned) pc);
+
+    cfg = (struct cfg *)malloc(sizeof(struct cfg));
+    analyze_function(cfg, pc);
+    print_cfg(cfg);
+
+    /* Show the raw fields of each instruction */
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-v") == 0)
+        {
+            for(i = 0; i < cfg->ninsts; i++)
+            {
+                printf("\n");
+                analyze_iw(pc[i]);
+            }
+            break;
+        }
+    }
+
+    if(out != NULL && export_cfg(cfg, name, out) != 0)
+    {
+        perror(out);
+        return 1;
+    }
 
     return 0;
 }
@@ -1,618 +1,5034 @@
+/* Input files may be larger than 2 GB */
+#define _FILE_OFFSET_BITS 64
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <math.h>
+
+#include "armstat.h"
+#include "functions.h"
 
 #define NREGS 16
-#define STACK_SIZE 1024
+#define NEXTREGS 64
+#define STACK_SIZE (64 * 1024)
 #define SP 13
 #define LR 14
 #define PC 15
 
+#define MAX_PREDICTORS 8
+#define BTB_SIZE 256
+#define RAS_SIZE 8
+#define STRIDE_TABLE_SIZE 64
+#define STREAM_DEPTH 4
+#define PREFETCH_LATENCY 8
+#define MAX_CORES 64
+#define MAX_DEVICES 8
+#define WHEEL_SLOTS 256
+#define UART_BUF_SIZE 128
+#define DEV_BASE 0xE0000000
+#define DEV_SIZE 0x1000
+#define MAX_ASM_FILES 16
+#define MAX_SYMBOLS 512
+#define SYMBOL_LEN 64
+#define MAX_OPERANDS 4
+#define ASM_LINE_LEN 256
+#define SH_STAGING_SIZE 4096
+#define SH_SMALL_WRITE 256
+#define MAX_BLOCKS 256
+#define MAX_LOOPS 64
+#define CFG_LINE_LEN 128
+#define INPUT_WINDOW (256 * 1024 * 1024)
+#define CM_DEPTH 4
+#define CM_WIDTH 1024
+#define HLL_BITS 6
+#define HLL_REGS (1 << HLL_BITS)
+#define HEAT_TOPK 8
+#define HEAT_TIMELINE 128
+#define PAGE_SHIFT 12
+#define LINE_SHIFT 6
+#define MMU_L1_BITS 10
+#define MMU_L2_BITS 10
+#define TLB_SIZE 64
+
 struct arm_state;
+struct loop_profile;
+struct heatmap;
+struct mmu;
+struct stats_export;
+struct cache;
+struct mapped_input;
+
+/* Guest faults that stop emulation */
+enum fault
+{
+    FAULT_NONE,
+    FAULT_STACK_OVERFLOW,
+    FAULT_DATA_ABORT,
+    FAULT_PREFETCH_ABORT,
+    FAULT_UNDEFINED
+};
+
+/* Page permissions, also the kinds of access checked against them */
+enum mmu_access
+{
+    MMU_READ,
+    MMU_WRITE,
+    MMU_EXEC
+};
+
+#define PTE_R (1 << MMU_READ)
+#define PTE_W (1 << MMU_WRITE)
+#define PTE_X (1 << MMU_EXEC)
 
-/* Assembly functions to emulate */
-int quadratic_a(int x, int a, int b, int c);
-int sum_array_a(int *array, int n);
-int find_max_a(int *array, int n);
-int fib_iter_a(int n);
-int fib_rec_a(int n);
-int strlen_a(char* a);
 void print_stats(struct arm_state *state);
+void loop_profile_reset(struct loop_profile *prof, unsigned int entry);
+void loop_profile_branch(struct loop_profile *prof, unsigned int target);
+void heatmap_reset(struct heatmap *heat);
+void prefetch_run_init(struct cache *dmc);
+int map_window(struct mapped_input *in, off_t offset);
+void stats_reset(struct arm_state *state);
 
 /* The complete machine state */
 struct arm_state
 {
     unsigned int regs[NREGS];
     unsigned int cpsr;
-    unsigned char stack[STACK_SIZE];
 
-    int branch_inst_count;
-    int dp_inst_count;
-    int mem_inst_count;
-    int total_inst_count;
-    int branch_taken;
-    int branch_not_taken;
+    /* VFP/NEON register file as 32-bit words: S[n] is ext[n], D[n] is
+     * ext[2n..2n+1] and Q[n] is ext[4n..4n+3]. Padded so a 128-bit
+     * access at D31 stays in bounds. */
+    unsigned int ext[NEXTREGS + 4];
+
+    /* Guest stack, reserved with mmap and committed a page at a time as
+     * the guest touches it. The page below it is a guard page. */
+    unsigned char *stack;
+    size_t stack_size;
+
+    /* Set when emulation stops on a guest fault */
+    int fault;
+    unsigned int fault_addr;
+    enum mmu_access fault_access;
+
+    /* Page tables checked on every fetch, load and store, NULL when
+     * guest memory is unprotected */
+    struct mmu *mmu;
+
+    unsigned long long branch_inst_count;
+    unsigned long long dp_inst_count;
+    unsigned long long mem_inst_count;
+    unsigned long long total_inst_count;
+    unsigned long long branch_taken;
+    unsigned long long branch_not_taken;
+
+    /* Exclusive monitor for ldrex/strex: the address and the value
+     * loaded by the last ldrex */
+    bool excl_valid;
+    unsigned int excl_addr;
+    unsigned int excl_val;
+
+    /* Host file output for semihosting calls */
+    struct semihost *sh;
+
+    /* Guest addresses in [bus_base, bus_base + bus_size) go to the device
+     * bus. next_event is the instruction count of the next device event. */
+    struct bus *bus;
+    unsigned int bus_base;
+    unsigned int bus_size;
+    unsigned long long next_event;
 
     struct cache *dmc;
+    struct timing *tm;
+    struct branch_unit *bpu;
+
+    /* Loop headers loaded from analyze output, NULL when not profiling */
+    struct loop_profile *prof;
+
+    /* Sampled memory access sketches, NULL when not sampling */
+    struct heatmap *heat;
+
+    /* Shared memory ring for live statistics, NULL when not exporting */
+    struct stats_export *stats;
 };
 
 
 struct cache
 {
     struct cache_slot *slots;
-    int hits;
-    int misses;
-    int requests;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long requests;
     int size;
+
+    struct prefetcher *pf;
+};
+
+/* Count-min sketch: each row hashes a key to one counter and the
+ * estimate is the smallest of its counters, never below the true count */
+struct count_min
+{
+    unsigned long long counts[CM_DEPTH][CM_WIDTH];
+};
+
+/* HyperLogLog distinct counter: each register keeps the longest run of
+ * leading zeros seen among the hashes routed to it */
+struct hll
+{
+    unsigned char regs[HLL_REGS];
+};
+
+struct heavy_hitter
+{
+    unsigned int page;
+    unsigned long long count;
+};
+
+/* Distinct pages and lines of one window. The registers are kept rather
+ * than the estimates so merged windows count the union of both. */
+struct heat_window
+{
+    struct hll pages;
+    struct hll lines;
+};
+
+/* Sampled memory accesses. Every rate-th access goes into the page and
+ * line sketches; windows of window instructions each get a working-set
+ * estimate. When the timeline fills up neighbouring windows are merged
+ * and the window doubles, so memory use stays fixed on long runs. */
+struct heatmap
+{
+    int rate;
+    int countdown;
+    unsigned long long base_window;
+    unsigned long long window;
+    unsigned long long window_end;
+    unsigned long long samples;
+
+    struct count_min pages;
+    struct count_min lines;
+    struct heavy_hitter top[HEAT_TOPK];
+    int ntop;
+
+    struct hll window_pages;
+    struct hll window_lines;
+    struct heat_window timeline[HEAT_TIMELINE];
+    int nwindows;
+};
+
+/* Where and how often snapshots of the running guest are published.
+ * next is the instruction count of the next snapshot. */
+struct stats_export
+{
+    struct stats_ring *ring;
+    unsigned long long interval;
+    unsigned long long next;
+    unsigned long long run;
+    unsigned long long last_inst;
+    unsigned long long last_ns;
+};
+
+/* A soft TLB entry holds, for each kind of access, the page base it
+ * allows (1, never a page base, when it does not) and what to add to a
+ * guest address in that page to get the host address */
+struct tlb_entry
+{
+    unsigned int tag[3];
+    unsigned int addend;
+};
+
+/* Two-level page table: the top 10 bits of an address pick a second
+ * level table, the next 10 bits a page table entry holding the host
+ * page base and its PTE_ permissions. Missing tables are unmapped. */
+struct mmu
+{
+    unsigned int *l1[1 << MMU_L1_BITS];
+    struct tlb_entry tlb[TLB_SIZE];
+    unsigned long long tlb_misses;
 };
 
+/* pf is set while a prefetched line has not yet been used by a demand
+ * access, ready is the instruction count at which the prefetch lands */
 struct cache_slot
 {
     unsigned int v;
     unsigned int tag;
+    unsigned int pf;
+    unsigned long long ready;
 };
 
-void struct_init(struct cache *dmc)
+/* Prefetcher kinds */
+enum pf_kind
 {
-    int i;
+    PF_NONE,
+    PF_NEXT_LINE,
+    PF_STRIDE,
+    PF_STREAM
+};
 
-    printf("Size: %d\n", dmc->size);
+char *pf_kind_names[] = {"none", "nextline", "stride", "stream"};
 
-    dmc->slots = (struct cache_slot *)malloc((sizeof(struct cache_slot)) * dmc->size);
+/* Per-PC stride table entry */
+struct stride_entry
+{
+    unsigned int tag;
+    unsigned int last_addr;
+    int stride;
+    int confidence;
+};
 
-    for(i = 0; i < dmc->size; i++)
-    {
-        dmc->slots[i].v = 0;
-        dmc->slots[i].tag = 0;
-    }
+struct prefetcher
+{
+    enum pf_kind kind;
 
-    dmc->hits = 0;
-    dmc->misses = 0;
-    dmc->requests = 0;
-}
+    struct stride_entry table[STRIDE_TABLE_SIZE];
 
-/* Initialize an arm_state struct with a function pointer and arguments */
-void arm_state_init(struct arm_state *as, unsigned int *func,
-                    unsigned int arg0, unsigned int arg1,
-                    unsigned int arg2, unsigned int arg3) {
-    int i;
+    /* Stream buffer of lines fetched ahead of the last miss, oldest first */
+    unsigned int stream[STREAM_DEPTH];
+    unsigned long long stream_ready[STREAM_DEPTH];
+    int stream_count;
 
-    /* Zero out all registers */
-    for(i = 0; i < NREGS; i++)
-    {
-        as->regs[i] = 0;
-    }
+    unsigned long long issued;
+    unsigned long long useful;
+    unsigned long long late;
+    unsigned long long useless;
+};
 
-    /* Zero out CPSR */
-    as->cpsr = 0;
+/* Instruction classes used to index the latency tables */
+enum inst_class
+{
+    CLASS_DP,
+    CLASS_MUL,
+    CLASS_MEM,
+    CLASS_BRANCH,
+    NUM_CLASSES
+};
 
-    /* Zero out the stack */
-    for(i = 0; i < STACK_SIZE; i++)
-    {
-        as->stack[i] = 0;
-    }
+/* A timing model is a per-class latency table plus the stall penalties */
+struct timing_model
+{
+    char *name;
+    int latency[NUM_CLASSES];
+    int load_use_penalty;
+    int branch_taken_penalty;
+    int cache_miss_penalty;
+};
 
-    /* Set the PC to point to the address of the function to emulate */
-    as->regs[PC] = (unsigned int) func;
+/* Latencies are in cycles, indexed by enum inst_class */
+struct timing_model timing_models[] =
+{
+    {"arm11",     {1, 3, 1, 1}, 2, 5, 20},
+    {"cortex-a7", {1, 2, 1, 1}, 1, 3, 12},
+    {"cortex-a9", {1, 2, 1, 1}, 1, 2, 10},
+    {"ideal",     {1, 1, 1, 1}, 0, 0, 0}
+};
 
-    /* Set the SP to the top of the stack (the stack grows down) */
-    as->regs[SP] = (unsigned int) &as->stack[STACK_SIZE];
+#define NUM_TIMING_MODELS ((int) (sizeof(timing_models) / sizeof(timing_models[0])))
 
-    /* Initialize LR to 0, this will be used to determine when the function has called bx lr */
-    as->regs[LR] = 0;
+/* Estimated cycle counts for one emulation run */
+struct timing
+{
+    struct timing_model *model;
+    unsigned int load_rd;
+    unsigned long long cycles;
+    unsigned long long base_cycles;
+    unsigned long long load_use_stalls;
+    unsigned long long branch_stalls;
+    unsigned long long cache_stalls;
+};
 
-    /* Initialize the first 4 arguments */
-    as->regs[0] = arg0;
-    as->regs[1] = arg1;
-    as->regs[2] = arg2;
-    as->regs[3] = arg3;
-    
-    as->branch_inst_count = 0;
-    as->dp_inst_count = 0;
-    as->mem_inst_count = 0;
-    as->total_inst_count = 0;
-    as->branch_taken = 0;
-    as->branch_not_taken = 0;
+void timing_init(struct timing *tm)
+{
+    /* NREGS means the previous instruction was not a load */
+    tm->load_rd = NREGS;
+    tm->cycles = 0;
+    tm->base_cycles = 0;
+    tm->load_use_stalls = 0;
+    tm->branch_stalls = 0;
+    tm->cache_stalls = 0;
 }
 
-/* Helper function to shift PC by the argument specifed in the 2nd value */
-void shift_pc(struct arm_state *state, int shift)
+/* Direction predictor kinds */
+enum bp_kind
 {
-    state->regs[PC] = state->regs[PC] + shift;
-}
+    BP_STATIC,
+    BP_BIMODAL,
+    BP_GSHARE,
+    BP_TOURNAMENT
+};
 
-/* Helper functions for increasing analysis count */
-void incrementDataProcessingCount(struct arm_state *state)
+char *bp_kind_names[] = {"static", "bimodal", "gshare", "tournament"};
+
+/* One direction predictor. Tables hold 2-bit saturating counters,
+ * bits is log2 of the number of table entries. */
+struct predictor
 {
-    state->dp_inst_count = state->dp_inst_count + 1;
-    state->total_inst_count = state->total_inst_count + 1;
-}
+    enum bp_kind kind;
+    int bits;
+    unsigned char *counters;
+    unsigned char *local;
+    unsigned char *chooser;
+    unsigned int history;
+    unsigned long long predictions;
+    unsigned long long mispredicts;
+};
 
-/* Helper functions for increasing memory count */
-void incrementMemoryCount(struct arm_state *state)
+struct btb_entry
 {
-    state->mem_inst_count = state->mem_inst_count + 1;
-    state->total_inst_count = state->total_inst_count + 1;
-}
+    unsigned int v;
+    unsigned int tag;
+    unsigned int target;
+};
 
-/* Helper functions for increasing branch count */
-void incrementBranchCount(struct arm_state *state)
+/* All predictors are trained from the same execution, alongside a
+ * shared BTB and return address stack */
+struct branch_unit
 {
-    state->branch_inst_count = state->branch_inst_count + 1;
-    state->total_inst_count = state->total_inst_count + 1;
-}
+    struct predictor preds[MAX_PREDICTORS];
+    int npreds;
 
-/*---------- Boolean Functions ----------*/
+    struct btb_entry btb[BTB_SIZE];
+    unsigned long long btb_hits;
+    unsigned long long btb_misses;
 
-/* Function to check op bits to ensure it is a data processing instruction */
-bool is_dp_inst(unsigned int iw)
+    unsigned int ras[RAS_SIZE];
+    int ras_top;
+    unsigned long long ras_hits;
+    unsigned long long ras_misses;
+};
+
+/* An input file mapped into the guest address space a window at a
+ * time. addr and len describe the window at offset in the file. */
+struct mapped_input
 {
-    unsigned int op = (iw >> 26) & 0b11;
-    return (op == 0);
-}
+    char *path;
+    bool readonly;
+    int fd;
+    off_t size;
+    off_t offset;
+    void *addr;
+    size_t len;
+};
 
-/* Separate data processing function to check for a mul instruction
- * given its differing location for opcode bits */
-bool is_mul_inst(unsigned int iw)
+/* A scheduled device event, fired once the guest instruction count
+ * reaches when */
+struct event
 {
-    unsigned int op;
-    unsigned int opcode;
+    unsigned long long when;
+    bool pending;
+    void (*fire)(struct arm_state *state, struct event *ev);
+    struct event *next;
+};
 
-    op = (iw >> 26) & 0b11;
-    opcode = (iw >> 4) & 0b1111;
+/* Hashed timing wheel: an event lives in slot when % WHEEL_SLOTS and
+ * events more than a turn ahead are skipped until their time comes */
+struct scheduler
+{
+    struct event *wheel[WHEEL_SLOTS];
+    unsigned long long last;
+    unsigned long long fired;
+};
 
-    return (op == 0) && (opcode == 0b1001);
-}
+/* A device model mapped at [base, base + size) */
+struct device
+{
+    char *name;
+    unsigned int base;
+    unsigned int size;
+    unsigned int (*read)(struct arm_state *state, unsigned int offset);
+    void (*write)(struct arm_state *state, unsigned int offset, unsigned int val);
+};
 
-/* Function to check op bits to ensure it is a memory instruction */
-bool is_mem_inst(unsigned int iw)
+struct uart
 {
-    unsigned int op = (iw >> 26) & 0b11;
-    return (op == 1);
-}
+    char buf[UART_BUF_SIZE];
+    int len;
+};
 
-/* Function to check bits to ensure it is a branch instruction */
-bool is_b_inst(unsigned int iw)
+struct timer
 {
-    unsigned int op = (iw >> 25) & 0b111;
-    return (op == 5);
-}
+    unsigned int load;
+    unsigned int ctrl;
+    struct event ev;
+};
 
-/* Given function to check for branch and exchange */
-bool is_bx_inst(unsigned int iw)
+struct intc
 {
-    unsigned int bx_code;
+    unsigned int pending;
+    unsigned int enable;
+};
 
-    bx_code = (iw >> 4) & 0x00FFFFFF;
+/* Devices are kept sorted by base for the range lookup */
+struct bus
+{
+    unsigned int base;
+    unsigned int size;
+    struct device devices[MAX_DEVICES];
+    int ndevices;
+    unsigned long long reads;
+    unsigned long long writes;
+
+    struct scheduler sched;
+    struct uart uart;
+    struct timer timer;
+    struct intc intc;
+};
 
-    return (bx_code == 0b000100101111111111110001);
-}
+/* An assembler label, local to the file it is defined in unless .global */
+struct symbol
+{
+    char name[SYMBOL_LEN];
+    int file;
+    bool global;
+    bool defined;
+    unsigned int addr;
+};
 
-/* Function to check for immediate value */
-bool is_imm(unsigned int iw) 
+/* Semihosting output batching. Small writes are copied into staging
+ * and go out together in one writev; a large write is handed to writev
+ * straight from guest memory along with whatever is staged. */
+struct semihost
 {
-    return ((iw >> 25) & 0b1 == 1);
-}
+    int fd;
+    char staging[SH_STAGING_SIZE];
+    size_t staged;
+    struct timespec start;
+
+    unsigned long long calls;
+    unsigned long long writes;
+    unsigned long long syscalls;
+};
 
-/* Function to check for op code value and compare to cpsr */
-bool is_condition(struct arm_state *state) {
-    unsigned int iw;
-    int cond, cpsr_cond;
+/* In-process assembler for the A32 subset the emulator executes */
+struct assembler
+{
+    char *names[MAX_ASM_FILES];
+    char *sources[MAX_ASM_FILES];
+    int nfiles;
 
-    iw = *((unsigned int *) state->regs[PC]);
-    cond = iw >> 28;
-    cpsr_cond = state->cpsr >> 28;
+    struct symbol symbols[MAX_SYMBOLS];
+    int nsymbols;
 
-    if(cond == 0b0000)
-    {
-        return cpsr_cond == 0b0000;
-    }
-    else if(cond == 0b0001)
-    {
-        return cpsr_cond == 0b1011 || cpsr_cond == 0b1100;
-    }
-    else if(cond == 0b1011)
-    {
-        return cpsr_cond == 0b1011;
-    }
-    else if(cond == 0b1100)
-    {
-        return cpsr_cond == 0b1100;
-    }
-}
+    unsigned int *code;
+    int ncode;
+};
 
-/*---------- Data Processing Emulation Functions ----------*/
+/* Base encodings of a vector arithmetic instruction as Advanced SIMD
+ * integer, Advanced SIMD F32 and VFP single precision, 0 where that form
+ * does not exist */
+struct asm_vop
+{
+    char *name;
+    unsigned int simd_int;
+    unsigned int simd_float;
+    unsigned int vfp;
+};
 
-void armemu_add(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+/* A loop found by analyze, counted each time a branch lands on its header */
+struct hot_loop
 {
-    unsigned int rm;
+    unsigned int header;
+    int depth;
+    int nblocks;
+    int count;
+};
 
-    if(is_imm(iw))
-    {
-        rm = iw & 0xFF;
-        state->regs[rd] = state->regs[rn] + rm;
-    }
-    else
+/* Block boundaries and loop headers of one function, from analyze -o.
+ * Offsets in the file are resolved to guest addresses at load time and
+ * the loops are kept sorted by header for the lookup on taken branches. */
+struct loop_profile
+{
+    char function[SYMBOL_LEN];
+    unsigned int base;
+    unsigned int end;
+    bool active;
+
+    unsigned int blocks[MAX_BLOCKS];
+    int nblocks;
+
+    struct hot_loop loops[MAX_LOOPS];
+    int nloops;
+};
+
+/* Guest program given as .s files on the command line */
+struct asm_run
+{
+    char *files[MAX_ASM_FILES];
+    int nfiles;
+    char *entry;
+    unsigned int args[4];
+    bool mmu;
+};
+
+struct timing_model *find_timing_model(char *name)
+{
+    int i;
+
+    for(i = 0; i < NUM_TIMING_MODELS; i++)
     {
-        rm = iw & 0xF;
-        state->regs[rd] = state->regs[rn] + state->regs[rm];
+        if(strcmp(timing_models[i].name, name) == 0)
+        {
+            return &timing_models[i];
+        }
     }
 
-    if(rd != PC) 
+    return NULL;
+}
+
+void struct_init(struct cache *dmc)
+{
+    int i;
+
+    printf("Size: %d\n", dmc->size);
+
+    dmc->slots = (struct cache_slot *)malloc((sizeof(struct cache_slot)) * dmc->size);
+
+    for(i = 0; i < dmc->size; i++)
     {
-        shift_pc(state, 4);
+        dmc->slots[i].v = 0;
+        dmc->slots[i].tag = 0;
+        dmc->slots[i].pf = 0;
+        dmc->slots[i].ready = 0;
     }
+
+    dmc->hits = 0;
+    dmc->misses = 0;
+    dmc->requests = 0;
 }
 
-void armemu_sub(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+/*-------- Guest Stacks -------- */
+
+/* The state whose guard pages the fault handler checks, and where to
+ * return to, for the guest running on this host thread */
+__thread struct arm_state *current_state;
+__thread sigjmp_buf fault_jmp;
+
+/* Host page size, cached because sysconf is not async-signal-safe */
+size_t fault_page_size;
+
+/* Reserve a guest stack of size bytes plus a guard page below it. The
+ * mapping is not backed until touched, so idle contexts cost only
+ * address space. */
+int arm_stack_alloc(struct arm_state *as, size_t size)
 {
-    unsigned int rm;
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char *region;
 
-    if(is_imm(iw))
+    size = (size + page - 1) & ~(page - 1);
+
+    region = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(region == MAP_FAILED)
     {
-        rm = iw & 0xFF;
-        state->regs[rd] = state->regs[rn] - rm;
+        return -1;
     }
-    else
+
+    if(mprotect(region, page, PROT_NONE) != 0)
     {
-        rm = iw & 0xF;
-        state->regs[rd] = state->regs[rn] - state->regs[rm];
+        munmap(region, size + page);
+        return -1;
+    }
+
+    as->stack = region + page;
+    as->stack_size = size;
+
+    return 0;
+}
+
+void arm_stack_free(struct arm_state *as)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    munmap(as->stack - page, as->stack_size + page);
+}
+
+/* A host fault in the guard page of the running guest is a guest stack
+ * overflow. Anything else is a real emulator crash and is re-raised
+ * with the default action. */
+void fault_handler(int sig, siginfo_t *info, void *context)
+{
+    unsigned char *addr = (unsigned char *) info->si_addr;
+    struct arm_state *as = current_state;
+
+    (void) context;
+
+    if(as != NULL && addr >= as->stack - fault_page_size && addr < as->stack)
+    {
+        as->fault = FAULT_STACK_OVERFLOW;
+        as->fault_addr = (unsigned int) addr;
+        siglongjmp(fault_jmp, 1);
+    }
+
+    signal(sig, SIG_DFL);
+}
+
+void fault_handler_install(void)
+{
+    struct sigaction sa;
+
+    fault_page_size = sysconf(_SC_PAGESIZE);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGSEGV, &sa, NULL);
+}
+
+/* Stop on an instruction the emulator does not implement rather than
+ * carry on with stale registers */
+void armemu_undefined(struct arm_state *state)
+{
+    state->fault = FAULT_UNDEFINED;
+    state->fault_addr = state->regs[PC];
+    siglongjmp(fault_jmp, 1);
+}
+
+/*-------- MMU -------- */
+
+/* Bounds of the host program's code, from the linker */
+extern char __executable_start[], etext[];
+
+void mmu_tlb_flush(struct mmu *mmu)
+{
+    int i;
+
+    for(i = 0; i < TLB_SIZE; i++)
+    {
+        mmu->tlb[i].tag[MMU_READ] = 1;
+        mmu->tlb[i].tag[MMU_WRITE] = 1;
+        mmu->tlb[i].tag[MMU_EXEC] = 1;
+    }
+}
+
+void mmu_init(struct mmu *mmu)
+{
+    memset(mmu->l1, 0, sizeof(mmu->l1));
+    mmu->tlb_misses = 0;
+    mmu_tlb_flush(mmu);
+}
+
+void mmu_free(struct mmu *mmu)
+{
+    int i;
+
+    for(i = 0; i < (1 << MMU_L1_BITS); i++)
+    {
+        free(mmu->l1[i]);
+    }
+    mmu_init(mmu);
+}
+
+/* Identity map the pages covering [start, start + len), adding perms to
+ * any already mapped */
+int mmu_map(struct mmu *mmu, unsigned int start, unsigned int len, unsigned int perms)
+{
+    unsigned int page = start & ~((1 << PAGE_SHIFT) - 1);
+    unsigned int last = (start + len - 1) & ~((1 << PAGE_SHIFT) - 1);
+    unsigned int *l2;
+
+    while(len > 0)
+    {
+        l2 = mmu->l1[page >> (PAGE_SHIFT + MMU_L2_BITS)];
+        if(l2 == NULL)
+        {
+            l2 = (unsigned int *)calloc(1 << MMU_L2_BITS, sizeof(unsigned int));
+            if(l2 == NULL)
+            {
+                return -1;
+            }
+            mmu->l1[page >> (PAGE_SHIFT + MMU_L2_BITS)] = l2;
+        }
+        l2[(page >> PAGE_SHIFT) & ((1 << MMU_L2_BITS) - 1)] |= page | perms;
+
+        if(page == last)
+        {
+            break;
+        }
+        page += 1 << PAGE_SHIFT;
+    }
+
+    mmu_tlb_flush(mmu);
+
+    return 0;
+}
+
+/* Walk the page table and refill the TLB entry, or stop the guest with
+ * an abort if the page is unmapped or does not allow the access */
+unsigned int mmu_miss(struct arm_state *state, unsigned int addr, enum mmu_access access)
+{
+    struct mmu *mmu = state->mmu;
+    struct tlb_entry *e = &mmu->tlb[(addr >> PAGE_SHIFT) % TLB_SIZE];
+    unsigned int page = addr & ~((1 << PAGE_SHIFT) - 1);
+    unsigned int *l2 = mmu->l1[addr >> (PAGE_SHIFT + MMU_L2_BITS)];
+    unsigned int pte = l2 == NULL ? 0 : l2[(addr >> PAGE_SHIFT) & ((1 << MMU_L2_BITS) - 1)];
+    unsigned int guard = (unsigned int) state->stack - sysconf(_SC_PAGESIZE);
+    int i;
+
+    mmu->tlb_misses++;
+
+    if((pte & (1 << access)) == 0)
+    {
+        if(addr - guard < (unsigned int) state->stack - guard)
+        {
+            state->fault = FAULT_STACK_OVERFLOW;
+        }
+        else
+        {
+            state->fault = access == MMU_EXEC ? FAULT_PREFETCH_ABORT : FAULT_DATA_ABORT;
+        }
+        state->fault_addr = addr;
+        state->fault_access = access;
+        siglongjmp(fault_jmp, 1);
+    }
+
+    for(i = MMU_READ; i <= MMU_EXEC; i++)
+    {
+        e->tag[i] = (pte & (1 << i)) ? page : 1;
+    }
+    e->addend = (pte & ~((1 << PAGE_SHIFT) - 1)) - page;
+
+    return addr + e->addend;
+}
+
+/* Guest to host address. A TLB hit is one compare and one add. */
+unsigned int mmu_translate(struct arm_state *state, unsigned int addr, enum mmu_access access)
+{
+    struct tlb_entry *e;
+
+    if(state->mmu == NULL)
+    {
+        return addr;
+    }
+
+    e = &state->mmu->tlb[(addr >> PAGE_SHIFT) % TLB_SIZE];
+    if(e->tag[access] == (addr & ~((1 << PAGE_SHIFT) - 1)))
+    {
+        return addr + e->addend;
+    }
+
+    return mmu_miss(state, addr, access);
+}
+
+/* Translate a len byte access at addr, checking its last byte too when
+ * the access crosses into the next page */
+unsigned int mmu_translate_range(struct arm_state *state, unsigned int addr, unsigned int len,
+                                 enum mmu_access access)
+{
+    if(state->mmu != NULL && ((addr ^ (addr + len - 1)) >> PAGE_SHIFT) != 0)
+    {
+        mmu_translate(state, addr + len - 1, access);
+    }
+
+    return mmu_translate(state, addr, access);
+}
+
+/* Check every page of a buffer the emulator accesses for the guest */
+void mmu_check_range(struct arm_state *state, unsigned int addr, unsigned int len, enum mmu_access access)
+{
+    unsigned int off;
+
+    if(state->mmu == NULL || len == 0)
+    {
+        return;
+    }
+
+    for(off = 0; off < len; off += 1 << PAGE_SHIFT)
+    {
+        mmu_translate(state, addr + off, access);
+    }
+    mmu_translate(state, addr + len - 1, access);
+}
+
+/* Check a NUL terminated guest string, a page at a time */
+void mmu_check_string(struct arm_state *state, unsigned int addr)
+{
+    if(state->mmu == NULL)
+    {
+        return;
+    }
+
+    mmu_translate(state, addr, MMU_READ);
+    while(*(char *) addr != '\0')
+    {
+        addr++;
+        if((addr & ((1 << PAGE_SHIFT) - 1)) == 0)
+        {
+            mmu_translate(state, addr, MMU_READ);
+        }
+    }
+}
+
+/* Initialize an arm_state struct with a function pointer and arguments */
+void arm_state_init(struct arm_state *as, unsigned int *func,
+                    unsigned int arg0, unsigned int arg1,
+                    unsigned int arg2, unsigned int arg3) {
+    int i;
+
+    /* Zero out all registers */
+    for(i = 0; i < NREGS; i++)
+    {
+        as->regs[i] = 0;
+    }
+
+    /* Zero out CPSR */
+    as->cpsr = 0;
+
+    /* Zero out the VFP/NEON registers */
+    for(i = 0; i < NEXTREGS + 4; i++)
+    {
+        as->ext[i] = 0;
+    }
+
+    /* Zero out the stack by dropping its pages, which also hands them
+     * back to the host until the guest touches them again */
+    madvise(as->stack, as->stack_size, MADV_DONTNEED);
+
+    as->fault = FAULT_NONE;
+    as->fault_addr = 0;
+
+    /* Sketches and loop counts are kept per run */
+    if(as->heat != NULL)
+    {
+        heatmap_reset(as->heat);
+    }
+    if(as->prof != NULL)
+    {
+        loop_profile_reset(as->prof, (unsigned int) func);
+    }
+
+    /* Set the PC to point to the address of the function to emulate */
+    as->regs[PC] = (unsigned int) func;
+
+    /* Set the SP to the top of the stack (the stack grows down) */
+    as->regs[SP] = (unsigned int) (as->stack + as->stack_size);
+
+    /* Initialize LR to 0, this will be used to determine when the function has called bx lr */
+    as->regs[LR] = 0;
+
+    /* Initialize the first 4 arguments */
+    as->regs[0] = arg0;
+    as->regs[1] = arg1;
+    as->regs[2] = arg2;
+    as->regs[3] = arg3;
+    
+    as->branch_inst_count = 0;
+    as->dp_inst_count = 0;
+    as->mem_inst_count = 0;
+    as->total_inst_count = 0;
+    as->branch_taken = 0;
+    as->branch_not_taken = 0;
+
+    as->excl_valid = false;
+
+    prefetch_run_init(as->dmc);
+
+    as->next_event = ULLONG_MAX;
+    if(as->stats != NULL)
+    {
+        stats_reset(as);
+    }
+
+    timing_init(as->tm);
+}
+
+/* Helper function to shift PC by the argument specifed in the 2nd value */
+void shift_pc(struct arm_state *state, int shift)
+{
+    state->regs[PC] = state->regs[PC] + shift;
+}
+
+/* Helper functions for increasing analysis count */
+void incrementDataProcessingCount(struct arm_state *state)
+{
+    state->dp_inst_count = state->dp_inst_count + 1;
+    state->total_inst_count = state->total_inst_count + 1;
+}
+
+/* Helper functions for increasing memory count */
+void incrementMemoryCount(struct arm_state *state)
+{
+    state->mem_inst_count = state->mem_inst_count + 1;
+    state->total_inst_count = state->total_inst_count + 1;
+}
+
+/* Helper functions for increasing branch count */
+void incrementBranchCount(struct arm_state *state)
+{
+    state->branch_inst_count = state->branch_inst_count + 1;
+    state->total_inst_count = state->total_inst_count + 1;
+}
+
+/*---------- Boolean Functions ----------*/
+
+/* Function to check op bits to ensure it is a data processing instruction */
+bool is_dp_inst(unsigned int iw)
+{
+    unsigned int op = (iw >> 26) & 0b11;
+    return (op == 0);
+}
+
+/* Separate data processing function to check for a mul instruction
+ * given its differing location for opcode bits */
+bool is_mul_inst(unsigned int iw)
+{
+    unsigned int op;
+    unsigned int opcode;
+
+    op = (iw >> 26) & 0b11;
+    opcode = (iw >> 4) & 0b1111;
+
+    return (op == 0) && (opcode == 0b1001);
+}
+
+/* Function to check op bits to ensure it is a memory instruction */
+bool is_mem_inst(unsigned int iw)
+{
+    unsigned int op = (iw >> 26) & 0b11;
+    return (op == 1);
+}
+
+/* Exclusive and barrier instructions overlap the mul and memory encodings,
+ * so they must be checked first */
+bool is_ldrex_inst(unsigned int iw)
+{
+    return (iw & 0x0FF00FFF) == 0x01900F9F;
+}
+
+bool is_strex_inst(unsigned int iw)
+{
+    return (iw & 0x0FF00FF0) == 0x01800F90;
+}
+
+bool is_dmb_inst(unsigned int iw)
+{
+    return (iw & 0xFFFFFFF0) == 0xF57FF050;
+}
+
+/* Advanced SIMD data processing, and VLD1/VST1 of multiple registers */
+bool is_neon_inst(unsigned int iw)
+{
+    return (iw >> 25) == 0b1111001 || (iw & 0xFF900000) == 0xF4000000;
+}
+
+/* VFP instructions in coprocessor space 10/11, including VDUP from a core register */
+bool is_vfp_inst(unsigned int iw)
+{
+    return (((iw >> 24) & 0xF) == 0b1110 && ((iw >> 9) & 0b111) == 0b101)
+        || (iw & 0x0F200E00) == 0x0D000A00;
+}
+
+/* Semihosting traps: svc 0x123456 or bkpt 0xab */
+bool is_semihost_inst(unsigned int iw)
+{
+    return (iw & 0x0FFFFFFF) == 0x0F123456 || (iw & 0x0FFFFFFF) == 0x01200A7B;
+}
+
+/* Function to check bits to ensure it is a branch instruction */
+bool is_b_inst(unsigned int iw)
+{
+    unsigned int op = (iw >> 25) & 0b111;
+    return (op == 5);
+}
+
+/* Given function to check for branch and exchange */
+bool is_bx_inst(unsigned int iw)
+{
+    unsigned int bx_code;
+
+    bx_code = (iw >> 4) & 0x00FFFFFF;
+
+    return (bx_code == 0b000100101111111111110001);
+}
+
+/* Function to check for immediate value */
+bool is_imm(unsigned int iw) 
+{
+    return ((iw >> 25) & 0b1 == 1);
+}
+
+/* Function to check for op code value and compare to cpsr */
+bool is_condition(struct arm_state *state) {
+    unsigned int iw;
+    int cond, cpsr_cond;
+
+    iw = *((unsigned int *) state->regs[PC]);
+    cond = iw >> 28;
+    cpsr_cond = state->cpsr >> 28;
+
+    if(cond == 0b0000)
+    {
+        return cpsr_cond == 0b0000;
+    }
+    else if(cond == 0b0001)
+    {
+        return cpsr_cond == 0b1011 || cpsr_cond == 0b1100;
+    }
+    else if(cond == 0b1011)
+    {
+        return cpsr_cond == 0b1011;
+    }
+    else if(cond == 0b1100)
+    {
+        return cpsr_cond == 0b1100;
+    }
+    else if(cond == 0b1110)
+    {
+        return true;
+    }
+
+    return false;
+}
+
+/*---------- Data Processing Emulation Functions ----------*/
+
+void armemu_add(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+{
+    unsigned int rm;
+
+    if(is_imm(iw))
+    {
+        rm = iw & 0xFF;
+        state->regs[rd] = state->regs[rn] + rm;
+    }
+    else
+    {
+        rm = iw & 0xF;
+        state->regs[rd] = state->regs[rn] + state->regs[rm];
+    }
+
+    if(rd != PC) 
+    {
+        shift_pc(state, 4);
+    }
+}
+
+void armemu_sub(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+{
+    unsigned int rm;
+
+    if(is_imm(iw))
+    {
+        rm = iw & 0xFF;
+        state->regs[rd] = state->regs[rn] - rm;
+    }
+    else
+    {
+        rm = iw & 0xF;
+        state->regs[rd] = state->regs[rn] - state->regs[rm];
+    }
+
+    if(rd != PC)
+    {
+        shift_pc(state, 4);
+    }
+}
+
+void armemu_mov(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+{
+    unsigned int rm;
+
+    if(is_imm(iw))
+    {
+        rn = iw & 0xFF;
+        state->regs[rd] = rn;
+    }
+    else
+    {
+        rn = iw & 0xF;
+        state->regs[rd] = state->regs[rn];
+    }
+
+    if(rd != PC)
+    {
+        shift_pc(state, 4);
+    }
+}
+
+void armemu_cmp(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+{
+    int cmp, rm;
+
+    /* Reset CPSR value */
+    state->cpsr = 0;
+
+    if(is_imm(iw))
+    {
+        rm = iw & 0xFF;
+        cmp = state->regs[rn] - rm;
+    }
+    else
+    {
+        rm = iw & 0xF;
+        cmp = state->regs[rn] - state->regs[rm];
+    }
+
+    /* Check comparision value and set cpsr*/
+    if(cmp == 0)
+    {
+        state->cpsr = 0;
+    }
+    else if(cmp < 0)
+    {
+        state->cpsr = (0b1011 << 28);
+    }
+    else if(cmp > 0)
+    {
+        state->cpsr = (0b1100 << 28);
+    }
+
+    if(rd != PC)
+    {
+        shift_pc(state, 4);
+    }
+}
+
+void armemu_mul(struct arm_state *state)
+{
+    unsigned int iw;
+    unsigned int rd, rn, rs;
+
+    iw = *((unsigned int *) state->regs[PC]);
+
+    rd = (iw >> 16) & 0xF;
+    rn = (iw >> 12) & 0xF;
+       rs = (iw >> 8) & 0xF;
+
+    state->regs[rd] = state->regs[rn] * state->regs[rs];
+
+    if(rd != PC)
+    {
+        shift_pc(state, 4);
+    }
+
+    incrementDataProcessingCount(state);
+}
+
+/*---------- Branching Emulation Functions ----------*/
+
+void armemu_b(struct arm_state *state)
+{
+    unsigned int iw;
+    int offset;
+
+    iw = *((unsigned int *) state->regs[PC]);
+    
+    /* Check the link bit to see if branching with a link */
+    if((iw >> 24) & 0b1 == 1)
+    {
+        state->regs[LR] = state->regs[PC] + 4;
+    }
+    
+    /* Grabbing the offset from the first 24 bits */
+    offset = iw & 0xFFFFFF;
+    offset = offset << 2;
+
+    /* Shift to the end of the offset and check the value of its last bit 
+     * if it starts with 1, we know it is a 2's complement number */
+    if((iw >> 23) & 0b1 == 1)
+    {
+        offset = offset | 0b111111 << 26;
+        offset = ~offset + 1;
+        offset = 0 - offset;
+    }
+
+    shift_pc(state, 8 + offset);
+
+    state->branch_taken = state->branch_taken + 1;
+}
+
+void armemu_bx(struct arm_state *state)
+{
+    unsigned int iw;
+    unsigned int rn;
+
+    iw = *((unsigned int *) state->regs[PC]);
+    rn = iw & 0b1111;
+
+    state->regs[PC] = state->regs[rn];
+
+    state->branch_taken = state->branch_taken + 1;
+    incrementBranchCount(state);
+}
+
+/*-------- Caching -------- */
+int get_slot(int size, unsigned int address)
+{
+    return (address >> 2) & (size -1);
+}
+
+/* The tag is every address bit above the word offset and slot index */
+unsigned int get_tag(int size, unsigned int address)
+{
+    int log2 = 0;
+    while(size > 1)
+    {
+        size = size >> 1;
+        log2 = log2+1;
+    }
+
+    return address >> (2 + log2);
+}
+
+unsigned int get_cache_vbit(struct cache * dmc, int slot)
+{
+    return dmc->slots[slot].v;
+}
+unsigned int get_cache_tag(struct cache * dmc, int slot)
+{
+    return dmc->slots[slot].tag;
+}
+
+void update_cache(struct cache * dmc, int slot, unsigned int tag)
+{
+    /* Evicting a prefetched line that was never used */
+    if(dmc->slots[slot].pf)
+    {
+        dmc->pf->useless++;
+    }
+
+    dmc->slots[slot].tag = tag;
+    dmc->slots[slot].v = 1;
+    dmc->slots[slot].pf = 0;
+}
+
+/*-------- Prefetching -------- */
+
+void prefetcher_init(struct prefetcher *pf)
+{
+    int i;
+
+    for(i = 0; i < STRIDE_TABLE_SIZE; i++)
+    {
+        pf->table[i].tag = 0;
+        pf->table[i].last_addr = 0;
+        pf->table[i].stride = 0;
+        pf->table[i].confidence = 0;
+    }
+
+    pf->stream_count = 0;
+    pf->issued = 0;
+    pf->useful = 0;
+    pf->late = 0;
+    pf->useless = 0;
+}
+
+/* Prefetch ready times are instruction counts, which restart with every
+ * run, so lines still in flight are treated as landed */
+void prefetch_run_init(struct cache *dmc)
+{
+    int i;
+
+    for(i = 0; i < dmc->size; i++)
+    {
+        dmc->slots[i].ready = 0;
+    }
+    for(i = 0; i < STREAM_DEPTH; i++)
+    {
+        dmc->pf->stream_ready[i] = 0;
+    }
+}
+
+/* Bring the line holding address into the cache ahead of demand */
+void prefetch_fill(struct cache *dmc, unsigned int address, unsigned long long now)
+{
+    int slot = get_slot(dmc->size, address);
+    unsigned int tag = get_tag(dmc->size, address);
+
+    if(get_cache_vbit(dmc, slot) && get_cache_tag(dmc, slot) == tag)
+    {
+        return;
+    }
+
+    update_cache(dmc, slot, tag);
+    dmc->slots[slot].pf = 1;
+    dmc->slots[slot].ready = now + PREFETCH_LATENCY;
+    dmc->pf->issued++;
+}
+
+/* Count a demand access to a prefetched line as useful, and late if the
+ * prefetch had not landed yet */
+void prefetch_used(struct prefetcher *pf, unsigned long long ready, unsigned long long now)
+{
+    pf->useful++;
+
+    if(now < ready)
+    {
+        pf->late++;
+    }
+}
+
+/* Refill the stream buffer with the lines following address */
+void stream_allocate(struct prefetcher *pf, unsigned int address, unsigned long long now)
+{
+    int i;
+
+    /* A hit removes its line from the buffer, so the lines still in it
+     * were all fetched and never used */
+    pf->useless += pf->stream_count;
+
+    for(i = 0; i < STREAM_DEPTH; i++)
+    {
+        pf->stream[i] = address + 4 * (i + 1);
+        pf->stream_ready[i] = now + PREFETCH_LATENCY * (i + 1);
+    }
+
+    pf->stream_count = STREAM_DEPTH;
+    pf->issued += STREAM_DEPTH;
+}
+
+/* Check the stream buffer on a demand miss. A hit moves the line into
+ * the cache; lines ahead of it were skipped over and are dropped as
+ * useless. The buffer is then topped up at the tail. */
+bool stream_lookup(struct prefetcher *pf, unsigned int address, unsigned long long now)
+{
+    int i, hit, left;
+
+    for(hit = 0; hit < pf->stream_count && pf->stream[hit] != address; hit++)
+    {
+    }
+    if(hit == pf->stream_count)
+    {
+        return false;
+    }
+
+    prefetch_used(pf, pf->stream_ready[hit], now);
+    pf->useless += hit;
+
+    left = pf->stream_count - hit - 1;
+    for(i = 0; i < left; i++)
+    {
+        pf->stream[i] = pf->stream[i + hit + 1];
+        pf->stream_ready[i] = pf->stream_ready[i + hit + 1];
+    }
+
+    for(i = left; i < STREAM_DEPTH; i++)
+    {
+        pf->stream[i] = (i == 0 ? address : pf->stream[i - 1]) + 4;
+        pf->stream_ready[i] = now + PREFETCH_LATENCY * (i - left + 1);
+        pf->issued++;
+    }
+    pf->stream_count = STREAM_DEPTH;
+
+    return true;
+}
+
+/* Train the per-PC stride table and prefetch once a stride repeats */
+void stride_train(struct cache *dmc, unsigned int address, unsigned int pc, unsigned long long now)
+{
+    struct stride_entry *e = &dmc->pf->table[(pc >> 2) & (STRIDE_TABLE_SIZE - 1)];
+    int stride;
+
+    if(e->tag != pc)
+    {
+        e->tag = pc;
+        e->last_addr = address;
+        e->stride = 0;
+        e->confidence = 0;
+        return;
+    }
+
+    stride = address - e->last_addr;
+
+    if(stride == e->stride)
+    {
+        if(e->confidence < 3)
+        {
+            e->confidence++;
+        }
+    }
+    else
+    {
+        e->stride = stride;
+        e->confidence = 0;
+    }
+
+    e->last_addr = address;
+
+    if(e->confidence >= 2 && e->stride != 0)
+    {
+        prefetch_fill(dmc, address + e->stride, now);
+    }
+}
+
+/* Let the prefetcher react to a demand access by the load/store at pc */
+void prefetch_train(struct cache *dmc, unsigned int address, unsigned int pc, unsigned long long now)
+{
+    switch(dmc->pf->kind)
+    {
+        case PF_NEXT_LINE:
+            /* Lines are one word */
+            prefetch_fill(dmc, address + 4, now);
+            break;
+        case PF_STRIDE:
+            stride_train(dmc, address, pc, now);
+            break;
+        default:
+            break;
+    }
+}
+
+/*-------- Cache Simulation -------- */
+
+/* Simulate a demand access to address by the load/store at pc, now being
+ * the current instruction count */
+void simulate_cache(struct cache * dmc, unsigned int address, unsigned int pc, unsigned long long now)
+{
+    int slot = get_slot(dmc->size, address);
+    unsigned int tag = get_tag(dmc->size, address);
+    unsigned int v = get_cache_vbit(dmc, slot);
+    unsigned int tagc = get_cache_tag(dmc, slot);
+
+    if(v && tag == tagc)
+    {
+        dmc->hits++;
+
+        if(dmc->slots[slot].pf)
+        {
+            prefetch_used(dmc->pf, dmc->slots[slot].ready, now);
+            dmc->slots[slot].pf = 0;
+        }
+    }
+    else if(dmc->pf->kind == PF_STREAM && stream_lookup(dmc->pf, address, now))
+    {
+        dmc->hits++;
+        update_cache(dmc, slot, tag);
+    }
+    else
+    {
+        dmc->misses++;
+        update_cache(dmc, slot, tag);
+
+        if(dmc->pf->kind == PF_STREAM)
+        {
+            stream_allocate(dmc->pf, address, now);
+        }
+    }
+    dmc->requests++;
+
+    prefetch_train(dmc, address, pc, now);
+}
+
+/*-------- Heat Map -------- */
+
+/* Multiplicative hash, a different odd multiplier per sketch row */
+unsigned int heat_hash(unsigned int key, int row)
+{
+    static const unsigned int seeds[CM_DEPTH + 1] =
+        {0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F, 0x165667B1};
+    unsigned int h = (key + row) * seeds[row];
+
+    /* Finish with a full avalanche so sequential pages and lines still
+     * spread over the HyperLogLog registers */
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+
+    return h ^ (h >> 16);
+}
+
+void count_min_add(struct count_min *cm, unsigned int key)
+{
+    int i;
+
+    for(i = 0; i < CM_DEPTH; i++)
+    {
+        cm->counts[i][heat_hash(key, i) % CM_WIDTH]++;
+    }
+}
+
+unsigned long long count_min_estimate(struct count_min *cm, unsigned int key)
+{
+    unsigned long long est = ULLONG_MAX, c;
+    int i;
+
+    for(i = 0; i < CM_DEPTH; i++)
+    {
+        c = cm->counts[i][heat_hash(key, i) % CM_WIDTH];
+        if(c < est)
+        {
+            est = c;
+        }
+    }
+
+    return est;
+}
+
+void hll_add(struct hll *hll, unsigned int key)
+{
+    unsigned int h = heat_hash(key, CM_DEPTH);
+    unsigned int reg = h >> (32 - HLL_BITS);
+    unsigned int rest = h << HLL_BITS;
+    unsigned char rank = rest == 0 ? 32 - HLL_BITS + 1 : __builtin_clz(rest) + 1;
+
+    if(rank > hll->regs[reg])
+    {
+        hll->regs[reg] = rank;
+    }
+}
+
+unsigned int hll_estimate(struct hll *hll)
+{
+    double sum = 0, est;
+    int i, zeros = 0;
+
+    for(i = 0; i < HLL_REGS; i++)
+    {
+        sum += 1.0 / (1u << hll->regs[i]);
+        zeros += hll->regs[i] == 0;
+    }
+
+    est = 0.709 * HLL_REGS * HLL_REGS / sum;
+
+    /* Linear counting is more accurate for small sets */
+    if(est <= 2.5 * HLL_REGS && zeros > 0)
+    {
+        est = HLL_REGS * log((double) HLL_REGS / zeros);
+    }
+
+    return (unsigned int) (est + 0.5);
+}
+
+void heatmap_init(struct heatmap *heat, int rate, unsigned long long window)
+{
+    heat->rate = rate;
+    heat->base_window = window;
+    heatmap_reset(heat);
+}
+
+void heatmap_reset(struct heatmap *heat)
+{
+    memset(&heat->pages, 0, sizeof(heat->pages));
+    memset(&heat->lines, 0, sizeof(heat->lines));
+    memset(&heat->window_pages, 0, sizeof(heat->window_pages));
+    memset(&heat->window_lines, 0, sizeof(heat->window_lines));
+    heat->countdown = heat->rate;
+    heat->window = heat->base_window;
+    heat->window_end = heat->window;
+    heat->samples = 0;
+    heat->ntop = 0;
+    heat->nwindows = 0;
+}
+
+/* Union of two distinct counters: the longer run in each register */
+void hll_merge(struct hll *dst, struct hll *a, struct hll *b)
+{
+    int i;
+
+    for(i = 0; i < HLL_REGS; i++)
+    {
+        dst->regs[i] = a->regs[i] > b->regs[i] ? a->regs[i] : b->regs[i];
+    }
+}
+
+/* Close the current window, halving the timeline when it is full */
+void heatmap_close_window(struct heatmap *heat)
+{
+    struct heat_window *tl = heat->timeline;
+    int i;
+
+    if(heat->nwindows == HEAT_TIMELINE)
+    {
+        for(i = 0; i < HEAT_TIMELINE / 2; i++)
+        {
+            hll_merge(&tl[i].pages, &tl[2 * i].pages, &tl[2 * i + 1].pages);
+            hll_merge(&tl[i].lines, &tl[2 * i].lines, &tl[2 * i + 1].lines);
+        }
+        heat->nwindows = HEAT_TIMELINE / 2;
+        heat->window *= 2;
+    }
+
+    tl[heat->nwindows].pages = heat->window_pages;
+    tl[heat->nwindows].lines = heat->window_lines;
+    heat->nwindows++;
+
+    memset(&heat->window_pages, 0, sizeof(heat->window_pages));
+    memset(&heat->window_lines, 0, sizeof(heat->window_lines));
+}
+
+/* Keep the pages with the highest estimated counts */
+void heatmap_top_update(struct heatmap *heat, unsigned int page, unsigned long long count)
+{
+    int i, min = 0;
+
+    for(i = 0; i < heat->ntop; i++)
+    {
+        if(heat->top[i].page == page)
+        {
+            heat->top[i].count = count;
+            return;
+        }
+        if(heat->top[i].count < heat->top[min].count)
+        {
+            min = i;
+        }
+    }
+
+    if(heat->ntop < HEAT_TOPK)
+    {
+        min = heat->ntop++;
+    }
+    else if(count <= heat->top[min].count)
+    {
+        return;
+    }
+
+    heat->top[min].page = page;
+    heat->top[min].count = count;
+}
+
+/* Record one sampled access */
+void heatmap_sample(struct heatmap *heat, unsigned int addr, unsigned long long now)
+{
+    unsigned int page = addr >> PAGE_SHIFT;
+    unsigned int line = addr >> LINE_SHIFT;
+
+    heat->countdown = heat->rate;
+    heat->samples++;
+
+    while(now >= heat->window_end)
+    {
+        heatmap_close_window(heat);
+        heat->window_end += heat->window;
+    }
+
+    count_min_add(&heat->pages, page);
+    count_min_add(&heat->lines, line);
+    hll_add(&heat->window_pages, page);
+    hll_add(&heat->window_lines, line);
+    heatmap_top_update(heat, page, count_min_estimate(&heat->pages, page));
+}
+
+/* Count down to the next sampled data access, if the heat map is on */
+void heatmap_access(struct arm_state *state, unsigned int addr)
+{
+    if(state->heat != NULL && --state->heat->countdown == 0)
+    {
+        heatmap_sample(state->heat, addr, state->total_inst_count);
+    }
+}
+
+/*-------- Branch Prediction -------- */
+
+/* Allocate a table of 2-bit counters initialized to weakly taken */
+unsigned char *bp_table_init(int bits)
+{
+    unsigned char *table = (unsigned char *)malloc(1 << bits);
+
+    memset(table, 2, 1 << bits);
+
+    return table;
+}
+
+void predictor_init(struct predictor *p, enum bp_kind kind, int bits)
+{
+    p->kind = kind;
+    p->bits = bits;
+    p->counters = NULL;
+    p->local = NULL;
+    p->chooser = NULL;
+    p->history = 0;
+    p->predictions = 0;
+    p->mispredicts = 0;
+
+    if(kind != BP_STATIC)
+    {
+        p->counters = bp_table_init(bits);
+    }
+    if(kind == BP_TOURNAMENT)
+    {
+        p->local = bp_table_init(bits);
+        p->chooser = bp_table_init(bits);
+    }
+}
+
+void branch_unit_init(struct branch_unit *bpu)
+{
+    int i;
+
+    /* Fall back to one of each kind when none were given on the command line */
+    if(bpu->npreds == 0)
+    {
+        predictor_init(&bpu->preds[bpu->npreds++], BP_STATIC, 0);
+        predictor_init(&bpu->preds[bpu->npreds++], BP_BIMODAL, 10);
+        predictor_init(&bpu->preds[bpu->npreds++], BP_GSHARE, 10);
+        predictor_init(&bpu->preds[bpu->npreds++], BP_TOURNAMENT, 10);
+    }
+
+    for(i = 0; i < BTB_SIZE; i++)
+    {
+        bpu->btb[i].v = 0;
+        bpu->btb[i].tag = 0;
+        bpu->btb[i].target = 0;
+    }
+
+    bpu->btb_hits = 0;
+    bpu->btb_misses = 0;
+    bpu->ras_top = 0;
+    bpu->ras_hits = 0;
+    bpu->ras_misses = 0;
+}
+
+/* Parse a predictor spec of the form kind[:bits] */
+int parse_predictor(struct branch_unit *bpu, char *spec)
+{
+    int kind, bits = 10;
+    char *colon = strchr(spec, ':');
+    int len = colon ? (int) (colon - spec) : (int) strlen(spec);
+
+    if(bpu->npreds == MAX_PREDICTORS)
+    {
+        return -1;
+    }
+
+    for(kind = BP_STATIC; kind <= BP_TOURNAMENT; kind++)
+    {
+        if(strncmp(spec, bp_kind_names[kind], len) == 0 && bp_kind_names[kind][len] == '\0')
+        {
+            break;
+        }
+    }
+    if(kind > BP_TOURNAMENT)
+    {
+        return -1;
+    }
+
+    if(colon)
+    {
+        bits = atoi(colon + 1);
+        if(bits < 1 || bits > 20)
+        {
+            return -1;
+        }
+    }
+
+    predictor_init(&bpu->preds[bpu->npreds++], kind, bits);
+
+    return 0;
+}
+
+void bp_counter_update(unsigned char *counter, bool taken)
+{
+    if(taken && *counter < 3)
+    {
+        *counter = *counter + 1;
+    }
+    else if(!taken && *counter > 0)
+    {
+        *counter = *counter - 1;
+    }
+}
+
+/* Predict the direction of the conditional branch at pc, then train on the outcome */
+void predictor_update(struct predictor *p, unsigned int iw, unsigned int pc, bool taken)
+{
+    unsigned int mask = (1 << p->bits) - 1;
+    unsigned int index = (pc >> 2) & mask;
+    unsigned int gindex = ((pc >> 2) ^ p->history) & mask;
+    bool prediction, local_pred, global_pred;
+
+    switch(p->kind)
+    {
+        case BP_STATIC:
+            /* Backward taken, forward not taken */
+            prediction = (iw >> 23) & 0b1;
+            break;
+        case BP_BIMODAL:
+            prediction = p->counters[index] >= 2;
+            bp_counter_update(&p->counters[index], taken);
+            break;
+        case BP_GSHARE:
+            prediction = p->counters[gindex] >= 2;
+            bp_counter_update(&p->counters[gindex], taken);
+            break;
+        case BP_TOURNAMENT:
+            local_pred = p->local[index] >= 2;
+            global_pred = p->counters[gindex] >= 2;
+            prediction = p->chooser[index] >= 2 ? global_pred : local_pred;
+
+            /* Move the chooser towards whichever component was right */
+            if(local_pred != global_pred)
+            {
+                bp_counter_update(&p->chooser[index], global_pred == taken);
+            }
+            bp_counter_update(&p->local[index], taken);
+            bp_counter_update(&p->counters[gindex], taken);
+            break;
+    }
+
+    p->history = ((p->history << 1) | taken) & mask;
+    p->predictions++;
+
+    if(prediction != taken)
+    {
+        p->mispredicts++;
+    }
+}
+
+/* Look up a taken branch in the BTB and install its target */
+void btb_update(struct branch_unit *bpu, unsigned int pc, unsigned int target)
+{
+    struct btb_entry *e = &bpu->btb[(pc >> 2) & (BTB_SIZE - 1)];
+
+    if(e->v && e->tag == pc && e->target == target)
+    {
+        bpu->btb_hits++;
+    }
+    else
+    {
+        bpu->btb_misses++;
+        e->v = 1;
+        e->tag = pc;
+        e->target = target;
+    }
+}
+
+void ras_push(struct branch_unit *bpu, unsigned int addr)
+{
+    /* The stack wraps, overwriting the oldest entry */
+    bpu->ras[bpu->ras_top % RAS_SIZE] = addr;
+    bpu->ras_top++;
+}
+
+void ras_pop(struct branch_unit *bpu, unsigned int target)
+{
+    if(bpu->ras_top > 0 && bpu->ras[(bpu->ras_top - 1) % RAS_SIZE] == target)
+    {
+        bpu->ras_hits++;
+    }
+    else
+    {
+        bpu->ras_misses++;
+    }
+
+    if(bpu->ras_top > 0)
+    {
+        bpu->ras_top--;
+    }
+}
+
+/* Feed one executed branch to every predictor. Called after the branch
+ * has run, so regs[PC] holds the actual next PC. */
+void branch_unit_update(struct arm_state *state, unsigned int iw, unsigned int pc)
+{
+    struct branch_unit *bpu = state->bpu;
+    unsigned int target = state->regs[PC];
+    bool taken = (target != pc + 4);
+    int i;
+
+    if(is_bx_inst(iw))
+    {
+        if((iw & 0xF) == LR)
+        {
+            ras_pop(bpu, target);
+        }
+        else
+        {
+            btb_update(bpu, pc, target);
+        }
+        return;
+    }
+
+    /* Only conditional branches need a direction prediction */
+    if((iw >> 28) != 0b1110)
+    {
+        for(i = 0; i < bpu->npreds; i++)
+        {
+            predictor_update(&bpu->preds[i], iw, pc, taken);
+        }
+    }
+
+    if(taken)
+    {
+        btb_update(bpu, pc, target);
+
+        if((iw >> 24) & 0b1)
+        {
+            ras_push(bpu, pc + 4);
+        }
+    }
+}
+
+/*-------- Timing -------- */
+
+/* Check whether the instruction reads register r as a source operand */
+bool reads_reg(unsigned int iw, enum inst_class class, unsigned int r)
+{
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int rd = (iw >> 12) & 0xF;
+    unsigned int rm = iw & 0xF;
+
+    switch(class)
+    {
+        case CLASS_MUL:
+            return rm == r || ((iw >> 8) & 0xF) == r;
+        case CLASS_MEM:
+            /* str reads rd, a register offset reads rm */
+            return rn == r
+                || (((iw >> 20) & 0b1) == 0 && rd == r)
+                || (((iw >> 25) & 0b1) == 1 && rm == r);
+        case CLASS_DP:
+            /* mov does not read rn */
+            return (((iw >> 21) & 0b1111) != 0b1101 && rn == r)
+                || (((iw >> 25) & 0b1) == 0 && rm == r);
+        case CLASS_BRANCH:
+            return is_bx_inst(iw) && rm == r;
+        default:
+            return false;
+    }
+}
+
+/* Charge the cycles for one executed instruction to the timing model.
+ * Called after the instruction has run, so the new PC tells us whether
+ * control flow was redirected. */
+void timing_account(struct arm_state *state, unsigned int iw, enum inst_class class,
+                    unsigned int pc, int cache_misses)
+{
+    struct timing *tm = state->tm;
+    struct timing_model *model = tm->model;
+    int cycles = model->latency[class];
+
+    tm->base_cycles += cycles;
+
+    if(tm->load_rd != NREGS && reads_reg(iw, class, tm->load_rd))
+    {
+        tm->load_use_stalls += model->load_use_penalty;
+        cycles += model->load_use_penalty;
+    }
+
+    if(class == CLASS_BRANCH && state->regs[PC] != pc + 4)
+    {
+        tm->branch_stalls += model->branch_taken_penalty;
+        cycles += model->branch_taken_penalty;
+    }
+
+    if(cache_misses)
+    {
+        tm->cache_stalls += cache_misses * model->cache_miss_penalty;
+        cycles += cache_misses * model->cache_miss_penalty;
+    }
+
+    /* Remember the destination of a core register load for the next
+     * instruction. VLDR and VLD1 name extension registers in bits 15-12
+     * and dmb has no destination, so they leave nothing to wait on. */
+    if(class == CLASS_MEM && ((iw >> 20) & 0b1) == 1
+       && (is_ldrex_inst(iw) || (is_mem_inst(iw) && (iw >> 28) != 0xF)))
+    {
+        tm->load_rd = (iw >> 12) & 0xF;
+    }
+    else
+    {
+        tm->load_rd = NREGS;
+    }
+
+    tm->cycles += cycles;
+}
+
+/*-------- Event Scheduler -------- */
+
+void sched_init(struct scheduler *sched)
+{
+    int i;
+
+    for(i = 0; i < WHEEL_SLOTS; i++)
+    {
+        sched->wheel[i] = NULL;
+    }
+
+    sched->last = 0;
+    sched->fired = 0;
+}
+
+/* The next instruction count armemu() stops at, for device events or
+ * for publishing statistics */
+void set_next_event(struct arm_state *state, unsigned long long next)
+{
+    if(state->stats != NULL && state->stats->next < next)
+    {
+        next = state->stats->next;
+    }
+
+    state->next_event = next;
+}
+
+/* Find the earliest pending event. Slots are checked in time order for
+ * one turn of the wheel, falling back to a full scan for far events. */
+void sched_update_next(struct arm_state *state)
+{
+    struct scheduler *sched = &state->bus->sched;
+    struct event *ev;
+    unsigned long long t, next = ULLONG_MAX;
+
+    for(t = sched->last + 1; t <= sched->last + WHEEL_SLOTS; t++)
+    {
+        for(ev = sched->wheel[t % WHEEL_SLOTS]; ev != NULL; ev = ev->next)
+        {
+            if(ev->when == t)
+            {
+                set_next_event(state, t);
+                return;
+            }
+            if(ev->when < next)
+            {
+                next = ev->when;
+            }
+        }
+    }
+
+    set_next_event(state, next);
+}
+
+void sched_add(struct arm_state *state, struct event *ev, unsigned long long when)
+{
+    struct scheduler *sched = &state->bus->sched;
+    int slot = when % WHEEL_SLOTS;
+
+    ev->when = when;
+    ev->pending = true;
+    ev->next = sched->wheel[slot];
+    sched->wheel[slot] = ev;
+
+    if(when < state->next_event)
+    {
+        state->next_event = when;
+    }
+}
+
+void sched_remove(struct arm_state *state, struct event *ev)
+{
+    struct event **p = &state->bus->sched.wheel[ev->when % WHEEL_SLOTS];
+
+    while(*p != NULL && *p != ev)
+    {
+        p = &(*p)->next;
+    }
+    if(*p == ev)
+    {
+        *p = ev->next;
+    }
+
+    ev->pending = false;
+    sched_update_next(state);
+}
+
+/* Fire every event that is due. Only called from armemu() once the
+ * instruction count reaches next_event, never polled per instruction. */
+void sched_run(struct arm_state *state)
+{
+    struct scheduler *sched = &state->bus->sched;
+    struct event **p, *ev;
+    unsigned long long now = state->total_inst_count;
+    unsigned long long t, end;
+
+    /* Visit each slot at most once */
+    end = now - sched->last < WHEEL_SLOTS ? now : sched->last + WHEEL_SLOTS;
+
+    for(t = sched->last + 1; t <= end; t++)
+    {
+        p = &sched->wheel[t % WHEEL_SLOTS];
+        while(*p != NULL)
+        {
+            ev = *p;
+            if(ev->when <= now)
+            {
+                *p = ev->next;
+                ev->pending = false;
+                sched->fired++;
+                ev->fire(state, ev);
+            }
+            else
+            {
+                p = &ev->next;
+            }
+        }
+    }
+
+    sched->last = now;
+    sched_update_next(state);
+}
+
+/*-------- Live Statistics -------- */
+
+unsigned long long stats_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Create or reuse the shared memory object name and map the ring */
+int stats_open(struct stats_export *stats, char *name, unsigned long long interval)
+{
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    int i;
+
+    if(fd < 0)
+    {
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(struct stats_ring)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    stats->ring = mmap(NULL, sizeof(struct stats_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(stats->ring == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    /* A ring left by an earlier armemu may still be mapped by readers, so
+     * it is continued rather than cleared: published keeps counting up and
+     * only a slot abandoned mid-write is closed. Anything else is new. */
+    if(stats->ring->magic == STATS_MAGIC && stats->ring->nslots == STATS_SLOTS)
+    {
+        for(i = 0; i < STATS_SLOTS; i++)
+        {
+            if(stats->ring->slots[i].seq & 1)
+            {
+                __atomic_store_n(&stats->ring->slots[i].seq, stats->ring->slots[i].seq + 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    else
+    {
+        memset(stats->ring, 0, sizeof(struct stats_ring));
+        stats->ring->nslots = STATS_SLOTS;
+        __atomic_store_n(&stats->ring->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    stats->interval = interval;
+    stats->run = 0;
+
+    return 0;
+}
+
+/* Counters restart with every run */
+void stats_reset(struct arm_state *state)
+{
+    struct stats_export *stats = state->stats;
+
+    stats->run++;
+    stats->next = stats->interval;
+    stats->last_inst = 0;
+    stats->last_ns = stats_now_ns();
+    set_next_event(state, state->next_event);
+}
+
+/* Copy the counters into the next slot under its sequence lock. The
+ * reader never blocks the writer; it retries on a torn copy. */
+void stats_publish(struct arm_state *state)
+{
+    struct stats_export *stats = state->stats;
+    struct stats_ring *ring = stats->ring;
+    struct stats_slot *slot = &ring->slots[ring->published % STATS_SLOTS];
+    struct stats_snapshot snap;
+    unsigned int seq = slot->seq;
+    unsigned long long now = stats_now_ns();
+
+    snap.run = stats->run;
+    snap.time_ns = now;
+    snap.total_inst_count = state->total_inst_count;
+    snap.dp_inst_count = state->dp_inst_count;
+    snap.mem_inst_count = state->mem_inst_count;
+    snap.branch_inst_count = state->branch_inst_count;
+    snap.branch_taken = state->branch_taken;
+    snap.branch_not_taken = state->branch_not_taken;
+    snap.cache_hits = state->dmc->hits;
+    snap.cache_misses = state->dmc->misses;
+    snap.cache_requests = state->dmc->requests;
+    snap.cycles = state->tm->cycles;
+    snap.mips = now == stats->last_ns ? 0 :
+                (double) (state->total_inst_count - stats->last_inst) * 1000 / (now - stats->last_ns);
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->snap = snap;
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->published, ring->published + 1, __ATOMIC_RELEASE);
+
+    stats->last_inst = state->total_inst_count;
+    stats->last_ns = now;
+}
+
+/* Called from armemu() once the instruction count reaches next_event */
+void armemu_events(struct arm_state *state)
+{
+    struct stats_export *stats = state->stats;
+
+    if(stats != NULL && state->total_inst_count >= stats->next)
+    {
+        stats_publish(state);
+        stats->next = state->total_inst_count + stats->interval;
+    }
+
+    if(state->bus != NULL)
+    {
+        sched_run(state);
+    }
+    else
+    {
+        set_next_event(state, ULLONG_MAX);
+    }
+}
+
+/*-------- Devices -------- */
+
+void uart_flush(struct uart *uart)
+{
+    fwrite(uart->buf, 1, uart->len, stdout);
+    uart->len = 0;
+}
+
+/* UART: a write to offset 0 transmits a character, offset 4 is the
+ * status register with the transmit-ready bit always set */
+unsigned int uart_read(struct arm_state *state, unsigned int offset)
+{
+    (void) state;
+    return offset == 0x4 ? 1 : 0;
+}
+
+void uart_write(struct arm_state *state, unsigned int offset, unsigned int val)
+{
+    struct uart *uart = &state->bus->uart;
+
+    if(offset != 0x0)
+    {
+        return;
+    }
+
+    uart->buf[uart->len++] = val & 0xFF;
+    if((val & 0xFF) == '\n' || uart->len == UART_BUF_SIZE)
+    {
+        uart_flush(uart);
+    }
+}
+
+/* Interrupt controller: 0x0 pending and enabled, 0x4 raw pending,
+ * 0x8 enable mask, writing 0xC clears pending bits. The emulator has no
+ * exception modes, so guest code polls for interrupts. */
+void intc_raise(struct arm_state *state, int line)
+{
+    state->bus->intc.pending |= 1 << line;
+}
+
+unsigned int intc_read(struct arm_state *state, unsigned int offset)
+{
+    struct intc *intc = &state->bus->intc;
+
+    switch(offset)
+    {
+        case 0x0:
+            return intc->pending & intc->enable;
+        case 0x4:
+            return intc->pending;
+        case 0x8:
+            return intc->enable;
+        default:
+            return 0;
+    }
+}
+
+void intc_write(struct arm_state *state, unsigned int offset, unsigned int val)
+{
+    struct intc *intc = &state->bus->intc;
+
+    if(offset == 0x8)
+    {
+        intc->enable = val;
+    }
+    else if(offset == 0xC)
+    {
+        intc->pending &= ~val;
+    }
+}
+
+/* Timer: 0x0 load, 0x4 current value, 0x8 control (bit 0 enable,
+ * bit 1 periodic). Counts down one per guest instruction and raises
+ * interrupt line 0 when it expires. */
+void timer_fire(struct arm_state *state, struct event *ev)
+{
+    struct timer *timer = &state->bus->timer;
+
+    intc_raise(state, 0);
+
+    /* A periodic timer reloaded with 0 would fire forever, so it stops */
+    if((timer->ctrl & 0b10) && timer->load > 0)
+    {
+        sched_add(state, ev, ev->when + timer->load);
+    }
+    else
+    {
+        timer->ctrl &= ~0b1;
+    }
+}
+
+unsigned int timer_read(struct arm_state *state, unsigned int offset)
+{
+    struct timer *timer = &state->bus->timer;
+
+    switch(offset)
+    {
+        case 0x0:
+            return timer->load;
+        case 0x4:
+            return timer->ev.pending ? timer->ev.when - state->total_inst_count : 0;
+        case 0x8:
+            return timer->ctrl;
+        default:
+            return 0;
+    }
+}
+
+void timer_write(struct arm_state *state, unsigned int offset, unsigned int val)
+{
+    struct timer *timer = &state->bus->timer;
+
+    if(offset == 0x0)
+    {
+        timer->load = val;
+    }
+    else if(offset == 0x8)
+    {
+        if(timer->ev.pending)
+        {
+            sched_remove(state, &timer->ev);
+        }
+
+        timer->ctrl = val;
+        if((val & 0b1) && timer->load > 0)
+        {
+            sched_add(state, &timer->ev, state->total_inst_count + timer->load);
+        }
+    }
+}
+
+/* Map a device at an offset into the bus window, keeping the table sorted */
+void bus_add_device(struct bus *bus, char *name, unsigned int offset, unsigned int size,
+                    unsigned int (*read)(struct arm_state *, unsigned int),
+                    void (*write)(struct arm_state *, unsigned int, unsigned int))
+{
+    int i = bus->ndevices;
+
+    while(i > 0 && bus->devices[i - 1].base > bus->base + offset)
+    {
+        bus->devices[i] = bus->devices[i - 1];
+        i--;
+    }
+
+    bus->devices[i].name = name;
+    bus->devices[i].base = bus->base + offset;
+    bus->devices[i].size = size;
+    bus->devices[i].read = read;
+    bus->devices[i].write = write;
+    bus->ndevices++;
+}
+
+void bus_init(struct bus *bus, unsigned int base)
+{
+    bus->base = base;
+    bus->size = DEV_SIZE;
+    bus->ndevices = 0;
+    bus->reads = 0;
+    bus->writes = 0;
+
+    bus->uart.len = 0;
+    bus->timer.load = 0;
+    bus->timer.ctrl = 0;
+    bus->timer.ev.pending = false;
+    bus->timer.ev.fire = timer_fire;
+    bus->intc.pending = 0;
+    bus->intc.enable = 0;
+    sched_init(&bus->sched);
+
+    bus_add_device(bus, "uart", 0x000, 0x100, uart_read, uart_write);
+    bus_add_device(bus, "timer", 0x100, 0x100, timer_read, timer_write);
+    bus_add_device(bus, "intc", 0x200, 0x100, intc_read, intc_write);
+}
+
+/* Connect the bus to a state that has just been initialized */
+void bus_attach(struct arm_state *state, struct bus *bus)
+{
+    state->bus = bus;
+    state->bus_base = bus->base;
+    state->bus_size = bus->size;
+    bus->sched.last = state->total_inst_count;
+    sched_update_next(state);
+}
+
+/* Binary search for the device holding addr, NULL if none */
+struct device *bus_find(struct bus *bus, unsigned int addr)
+{
+    int lo = 0, hi = bus->ndevices - 1, mid;
+
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if(addr < bus->devices[mid].base)
+        {
+            hi = mid - 1;
+        }
+        else if(addr >= bus->devices[mid].base + bus->devices[mid].size)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            return &bus->devices[mid];
+        }
+    }
+
+    return NULL;
+}
+
+/* Unmapped addresses in the window read as 0 and ignore writes */
+unsigned int bus_read(struct arm_state *state, unsigned int addr)
+{
+    struct device *dev = bus_find(state->bus, addr);
+
+    state->bus->reads++;
+
+    return dev ? dev->read(state, addr - dev->base) : 0;
+}
+
+void bus_write(struct arm_state *state, unsigned int addr, unsigned int val)
+{
+    struct device *dev = bus_find(state->bus, addr);
+
+    state->bus->writes++;
+
+    if(dev)
+    {
+        dev->write(state, addr - dev->base, val);
+    }
+}
+
+/*-------- Primary Functions -------- */
+
+/* Function to execute a data processing instruction depending on the provided opcode */
+void armemu_dp(struct arm_state *state)
+{
+    unsigned int rd, rn;
+    unsigned int iw = *((unsigned int *) state->regs[PC]);
+    unsigned int opcode = (iw >> 21) & 0b1111;
+
+    rd = (iw >> 12) & 0xF;
+    rn = (iw >> 16) & 0xF;
+
+    switch(opcode)
+    {
+        case 0b0100:
+            armemu_add(state, iw, rd, rn);
+            break;
+        case 0b0010:
+            armemu_sub(state, iw, rd, rn);
+            break;
+        case 0b1010:
+            armemu_cmp(state, iw, rd, rn);
+            break;
+        case 0b1101:
+            armemu_mov(state, iw, rd, rn);
+            break;
+        default:
+            break;
+    }
+
+    incrementDataProcessingCount(state);
+}
+
+/* Function to execute commands such as str and ldr */
+void armemu_mem(struct arm_state *state)
+{
+    unsigned int rd, rn, rm, val, addr, host;
+    unsigned int iw = *((unsigned int *) state->regs[PC]);
+    int offset;
+
+    rd = (iw >> 12) & 0xF;
+    rn = (iw >> 16) & 0xF;
+
+    /* if the value at this bit is 1, we know
+     * the offset is a register, so we set it accordingly */
+    if((iw >> 25) & 0b1 == 1)
+    {
+        rm = iw & 0xF;
+        offset = state->regs[rm];
+    }
+    /* Otherwise, retrieve the immediate value offset */
+    else
+    {
+        offset = iw & 0xFFF;
+    }
+
+    /* With the U bit clear the offset is subtracted */
+    if(((iw >> 23) & 0b1) == 0)
+    {
+        offset = -offset;
+    }
+
+    addr = state->regs[rn] + offset;
+
+    /* Device accesses bypass the cache, everything else is RAM */
+    if(addr - state->bus_base < state->bus_size)
+    {
+        if(((iw >> 20) & 0b1) == 1)
+        {
+            state->regs[rd] = bus_read(state, addr);
+        }
+        else
+        {
+            bus_write(state, addr, state->regs[rd]);
+        }
+    }
+    else
+    {
+        simulate_cache(state->dmc, addr, state->regs[PC], state->total_inst_count);
+        heatmap_access(state, addr);
+
+        /* Shift to the load/store bit & check whether we str or ldr */
+        if(((iw >> 20) & 0b1) == 1)
+        {
+            /* Shift to the byte/word bit & check if we are transferring a word or byte quantity */
+            if(((iw >> 22) & 0b1) == 1)
+            {
+                host = mmu_translate(state, addr, MMU_READ);
+                val = *((unsigned char *) host);
+            }
+            else
+            {
+                host = mmu_translate_range(state, addr, 4, MMU_READ);
+                val = *((unsigned int *) host);
+            }
+
+            /* Store the value in the register */
+            state->regs[rd] = val;
+        }
+        /* Otherwise, load the value from a register */
+        else
+        {
+            val = state->regs[rd];
+            if(((iw >> 22) & 0b1) == 1)
+            {
+                host = mmu_translate(state, addr, MMU_WRITE);
+                *(unsigned char *) host = val;
+            }
+            else
+            {
+                host = mmu_translate_range(state, addr, 4, MMU_WRITE);
+                *(unsigned int *) host = val;
+            }
+        }
     }
 
     if(rd != PC)
     {
-        shift_pc(state, 4);
+        state->regs[PC] = state->regs[PC] + 4;
+    }
+
+    incrementMemoryCount(state);
+}
+
+/*-------- Semihosting -------- */
+
+/* Semihosting operation numbers, passed in r0 */
+#define SYS_OPEN 0x01
+#define SYS_CLOSE 0x02
+#define SYS_WRITE 0x05
+#define SYS_READ 0x06
+#define SYS_CLOCK 0x10
+
+void semihost_init(struct semihost *sh)
+{
+    sh->fd = -1;
+    sh->staged = 0;
+    sh->calls = 0;
+    sh->writes = 0;
+    sh->syscalls = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sh->start);
+}
+
+/* Write the staged bytes followed by buf in one writev. Returns the
+ * number of bytes of buf that could not be written. */
+size_t semihost_writev(struct semihost *sh, void *buf, size_t len)
+{
+    struct iovec iov[2];
+    int n = 0;
+    ssize_t r;
+    size_t staged = sh->staged;
+
+    if(sh->fd < 0 || (staged == 0 && len == 0))
+    {
+        /* Nothing staged for a bad handle may reach the next good one */
+        sh->staged = 0;
+        return len;
+    }
+
+    if(staged > 0)
+    {
+        iov[n].iov_base = sh->staging;
+        iov[n].iov_len = staged;
+        n++;
+    }
+    if(len > 0)
+    {
+        iov[n].iov_base = buf;
+        iov[n].iov_len = len;
+        n++;
+    }
+
+    /* Keep host stdio output in order with guest output */
+    fflush(NULL);
+
+    while(n > 0)
+    {
+        r = writev(sh->fd, iov, n);
+        sh->syscalls++;
+        if(r < 0)
+        {
+            break;
+        }
+
+        /* Skip whatever was written and go again for the rest */
+        while(n > 0 && (size_t) r >= iov[0].iov_len)
+        {
+            r -= iov[0].iov_len;
+            if(n == 2)
+            {
+                iov[0] = iov[1];
+            }
+            n--;
+        }
+        if(n > 0)
+        {
+            iov[0].iov_base = (char *) iov[0].iov_base + r;
+            iov[0].iov_len -= r;
+        }
+    }
+
+    sh->staged = 0;
+
+    /* On a host error report all of buf as not written */
+    return n == 0 ? 0 : len;
+}
+
+void semihost_flush(struct semihost *sh)
+{
+    semihost_writev(sh, NULL, 0);
+}
+
+size_t semihost_write(struct semihost *sh, int fd, void *buf, size_t len)
+{
+    sh->writes++;
+
+    if(fd != sh->fd)
+    {
+        semihost_flush(sh);
+        sh->fd = fd;
+    }
+
+    if(len > SH_SMALL_WRITE)
+    {
+        return semihost_writev(sh, buf, len);
+    }
+
+    if(sh->staged + len > SH_STAGING_SIZE)
+    {
+        semihost_flush(sh);
+    }
+
+    memcpy(sh->staging + sh->staged, buf, len);
+    sh->staged += len;
+
+    return 0;
+}
+
+/* Open with the semihosting mode 0-11 (fopen r, rb, r+, r+b, w, wb, w+,
+ * w+b, a, ab, a+, a+b). The name ":tt" is the console. */
+int semihost_open(char *name, int mode)
+{
+    int flags[] = {O_RDONLY, O_RDWR, O_WRONLY | O_CREAT | O_TRUNC,
+                   O_RDWR | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND,
+                   O_RDWR | O_CREAT | O_APPEND};
+
+    if(mode < 0 || mode > 11)
+    {
+        return -1;
+    }
+
+    if(strcmp(name, ":tt") == 0)
+    {
+        return mode < 4 ? STDIN_FILENO : mode < 8 ? STDOUT_FILENO : STDERR_FILENO;
+    }
+
+    return open(name, flags[mode / 2], 0666);
+}
+
+/* Code run under the MMU is untrusted, so it only gets the console: it
+ * can open :tt and use the standard descriptors, and nothing the
+ * emulator itself has open */
+bool semihost_allowed(struct arm_state *state, unsigned int fd)
+{
+    return state->mmu == NULL || fd <= STDERR_FILENO;
+}
+
+/* Handle a semihosting trap. r0 holds the operation, r1 points to the
+ * parameter block in guest memory and the result goes back in r0. */
+void armemu_semihost(struct arm_state *state)
+{
+    struct semihost *sh = state->sh;
+    unsigned int *args = (unsigned int *) state->regs[1];
+    struct timespec now;
+    ssize_t r;
+    int result = -1;
+
+    if(sh == NULL)
+    {
+        state->regs[0] = -1;
+        return;
+    }
+
+    sh->calls++;
+
+    /* The parameter block and any buffers are guest memory too */
+    mmu_check_range(state, (unsigned int) args, 3 * sizeof(unsigned int), MMU_READ);
+
+    switch(state->regs[0])
+    {
+        case SYS_OPEN:
+            mmu_check_string(state, args[0]);
+            if(state->mmu != NULL && strcmp((char *) args[0], ":tt") != 0)
+            {
+                break;
+            }
+            result = semihost_open((char *) args[0], args[1]);
+            break;
+        case SYS_CLOSE:
+            if(!semihost_allowed(state, args[0]))
+            {
+                break;
+            }
+            if((int) args[0] == sh->fd)
+            {
+                semihost_flush(sh);
+                sh->fd = -1;
+            }
+            result = args[0] > STDERR_FILENO ? close(args[0]) : 0;
+            break;
+        case SYS_WRITE:
+            mmu_check_range(state, args[1], args[2], MMU_READ);
+            if((int) args[0] < 0 || !semihost_allowed(state, args[0]))
+            {
+                result = args[2];
+                break;
+            }
+            result = semihost_write(sh, args[0], (void *) args[1], args[2]);
+            break;
+        case SYS_READ:
+            /* Reads see everything written before them */
+            semihost_flush(sh);
+            mmu_check_range(state, args[1], args[2], MMU_WRITE);
+            if(!semihost_allowed(state, args[0]))
+            {
+                result = args[2];
+                break;
+            }
+            r = read(args[0], (void *) args[1], args[2]);
+            sh->syscalls++;
+            result = r < 0 ? args[2] : args[2] - r;
+            break;
+        case SYS_CLOCK:
+            /* Centiseconds since the emulator started */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            result = (now.tv_sec - sh->start.tv_sec) * 100
+                   + (now.tv_nsec - sh->start.tv_nsec) / 10000000;
+            break;
+        default:
+            break;
+    }
+
+    state->regs[0] = result;
+}
+
+/*-------- SIMD -------- */
+
+/* Host vector types. GCC lowers arithmetic on these to the host SIMD
+ * unit (NEON on ARM, SSE/AVX on x86), so each guest vector op becomes
+ * one host vector op rather than a loop over lanes. */
+typedef signed char v16qi __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+typedef unsigned short v8hu __attribute__((vector_size(16)));
+typedef unsigned int v4su __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+
+/* Apply expr to the 128 bits at vn and vm and store len bytes to vd */
+#define SIMD_BINOP(type, vd, vn, vm, len, expr)  \
+    do {                                         \
+        type a, b, d, r;                         \
+        memcpy(&a, vn, 16);                      \
+        memcpy(&b, vm, 16);                      \
+        memcpy(&d, vd, 16);                      \
+        r = (expr);                              \
+        memcpy(vd, &r, len);                     \
+    } while(0)
+
+/* Same operation for each integer element size */
+#define SIMD_INT_OP(size, u, vd, vn, vm, len, expr)                                  \
+    do {                                                                            \
+        if(size == 0 && u) SIMD_BINOP(v16qu, vd, vn, vm, len, expr);                \
+        else if(size == 0) SIMD_BINOP(v16qi, vd, vn, vm, len, expr);                \
+        else if(size == 1 && u) SIMD_BINOP(v8hu, vd, vn, vm, len, expr);            \
+        else if(size == 1) SIMD_BINOP(v8hi, vd, vn, vm, len, expr);                 \
+        else if(u) SIMD_BINOP(v4su, vd, vn, vm, len, expr);                         \
+        else SIMD_BINOP(v4si, vd, vn, vm, len, expr);                               \
+    } while(0)
+
+/* Pointer to D register n */
+unsigned char *simd_dreg(struct arm_state *state, unsigned int n)
+{
+    return (unsigned char *) &state->ext[2 * n];
+}
+
+/* Execute an Advanced SIMD three-registers-of-the-same-length instruction:
+ * VADD, VSUB, VMUL, VMLA, VMLS, VMAX and VMIN, integer and F32 */
+void armemu_simd_dp(struct arm_state *state, unsigned int iw)
+{
+    unsigned int u = (iw >> 24) & 0b1;
+    unsigned int op_a = (iw >> 8) & 0b1111;
+    unsigned int op_b = (iw >> 4) & 0b1;
+    unsigned int size = (iw >> 20) & 0b11;
+    unsigned int op = (iw >> 21) & 0b1;
+    unsigned int len = ((iw >> 6) & 0b1) ? 16 : 8;
+    unsigned char *vd = simd_dreg(state, ((iw >> 18) & 0x10) | ((iw >> 12) & 0xF));
+    unsigned char *vn = simd_dreg(state, ((iw >> 3) & 0x10) | ((iw >> 16) & 0xF));
+    unsigned char *vm = simd_dreg(state, ((iw >> 1) & 0x10) | (iw & 0xF));
+
+    /* Only the three-same group (bit 23 clear) is supported */
+    if((iw >> 23) & 0b1)
+    {
+        armemu_undefined(state);
+    }
+
+    switch(op_a)
+    {
+        case 0b1000:
+            if(size == 0b11 || op_b == 1)
+            {
+                armemu_undefined(state);
+            }
+            else if(u == 0)
+            {
+                SIMD_INT_OP(size, 0, vd, vn, vm, len, a + b);
+            }
+            else
+            {
+                SIMD_INT_OP(size, 0, vd, vn, vm, len, a - b);
+            }
+            break;
+        case 0b1001:
+            if(size == 0b11)
+            {
+                armemu_undefined(state);
+            }
+            else if(op_b == 0 && u == 0)
+            {
+                SIMD_INT_OP(size, 0, vd, vn, vm, len, d + a * b);
+            }
+            else if(op_b == 0)
+            {
+                SIMD_INT_OP(size, 0, vd, vn, vm, len, d - a * b);
+            }
+            else if(u == 0)
+            {
+                SIMD_INT_OP(size, 0, vd, vn, vm, len, a * b);
+            }
+            else
+            {
+                armemu_undefined(state);
+            }
+            break;
+        case 0b0110:
+            /* Comparisons yield all-ones lanes, used as a select mask */
+            if(size == 0b11)
+            {
+                armemu_undefined(state);
+            }
+            else if(op_b == 0)
+            {
+                SIMD_INT_OP(size, u, vd, vn, vm, len, ((a > b) & a) | (~(a > b) & b));
+            }
+            else
+            {
+                SIMD_INT_OP(size, u, vd, vn, vm, len, ((a < b) & a) | (~(a < b) & b));
+            }
+            break;
+        case 0b1101:
+            if(size & 0b1)
+            {
+                armemu_undefined(state);
+            }
+            else if(op_b == 0 && u == 0)
+            {
+                if(op == 0)
+                {
+                    SIMD_BINOP(v4sf, vd, vn, vm, len, a + b);
+                }
+                else
+                {
+                    SIMD_BINOP(v4sf, vd, vn, vm, len, a - b);
+                }
+            }
+            else if(op_b == 1 && u == 0)
+            {
+                if(op == 0)
+                {
+                    SIMD_BINOP(v4sf, vd, vn, vm, len, d + a * b);
+                }
+                else
+                {
+                    SIMD_BINOP(v4sf, vd, vn, vm, len, d - a * b);
+                }
+            }
+            else if(op_b == 1 && u == 1 && op == 0)
+            {
+                SIMD_BINOP(v4sf, vd, vn, vm, len, a * b);
+            }
+            else
+            {
+                /* VPADD, VABD, VMUL with op set and the compares */
+                armemu_undefined(state);
+            }
+            break;
+        case 0b1111:
+            if(op_b == 0 && u == 0 && (size & 0b1) == 0)
+            {
+                v4si mask;
+                v4sf a_f, b_f, r_f;
+
+                memcpy(&a_f, vn, 16);
+                memcpy(&b_f, vm, 16);
+                mask = op == 0 ? a_f > b_f : a_f < b_f;
+                r_f = (v4sf) ((mask & (v4si) a_f) | (~mask & (v4si) b_f));
+                memcpy(vd, &r_f, len);
+            }
+            else
+            {
+                armemu_undefined(state);
+            }
+            break;
+        default:
+            armemu_undefined(state);
+            break;
+    }
+}
+
+/* VLD1/VST1 of 1 to 4 consecutive D registers */
+void armemu_simd_mem(struct arm_state *state, unsigned int iw)
+{
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int rm = iw & 0xF;
+    unsigned int dd = ((iw >> 18) & 0x10) | ((iw >> 12) & 0xF);
+    unsigned int type = (iw >> 8) & 0b1111;
+    unsigned int addr = state->regs[rn];
+    int nregs, i;
+
+    switch(type)
+    {
+        case 0b0111:
+            nregs = 1;
+            break;
+        case 0b1010:
+            nregs = 2;
+            break;
+        case 0b0110:
+            nregs = 3;
+            break;
+        case 0b0010:
+            nregs = 4;
+            break;
+        default:
+            return;
+    }
+
+    for(i = 0; i < nregs * 2; i++)
+    {
+        simulate_cache(state->dmc, addr + i * 4, state->regs[PC], state->total_inst_count);
+    }
+    heatmap_access(state, addr);
+
+    /* Pages are identity mapped, so once every page of the transfer is
+     * checked it is contiguous on the host too */
+    mmu_check_range(state, addr, nregs * 8, ((iw >> 21) & 0b1) ? MMU_READ : MMU_WRITE);
+
+    /* Elements are stored in order, so on a little-endian host any
+     * element size is a straight copy */
+    if((iw >> 21) & 0b1)
+    {
+        memcpy(simd_dreg(state, dd), (void *) addr, nregs * 8);
+    }
+    else
+    {
+        memcpy((void *) addr, simd_dreg(state, dd), nregs * 8);
+    }
+
+    /* Rm of 15 means no writeback, 13 means post-increment by the transfer size */
+    if(rm == 13)
+    {
+        state->regs[rn] = addr + nregs * 8;
+    }
+    else if(rm != PC)
+    {
+        state->regs[rn] = addr + state->regs[rm];
+    }
+}
+
+/* VDUP of a core register to every element of a D or Q register */
+void armemu_vdup(struct arm_state *state, unsigned int iw)
+{
+    unsigned int rt = (iw >> 12) & 0xF;
+    unsigned int dd = ((iw >> 3) & 0x10) | ((iw >> 16) & 0xF);
+    unsigned int len = ((iw >> 21) & 0b1) ? 16 : 8;
+    unsigned int be = (((iw >> 22) & 0b1) << 1) | ((iw >> 5) & 0b1);
+    unsigned int val = state->regs[rt];
+    v4su r;
+
+    if(be == 0b10)
+    {
+        r = (v4su) {0, 0, 0, 0} + (val & 0xFF) * 0x01010101;
+    }
+    else if(be == 0b01)
+    {
+        r = (v4su) {0, 0, 0, 0} + (val & 0xFFFF) * 0x00010001;
+    }
+    else
+    {
+        r = (v4su) {0, 0, 0, 0} + val;
+    }
+
+    memcpy(simd_dreg(state, dd), &r, len);
+}
+
+/* Single-precision VFP: VADD, VSUB, VMUL, VMLA, VMLS, VDIV, VMOV to and
+ * from core registers and VLDR/VSTR */
+void armemu_vfp(struct arm_state *state, unsigned int iw)
+{
+    unsigned int sd = (((iw >> 12) & 0xF) << 1) | ((iw >> 22) & 0b1);
+    unsigned int sn = (((iw >> 16) & 0xF) << 1) | ((iw >> 7) & 0b1);
+    unsigned int sm = ((iw & 0xF) << 1) | ((iw >> 5) & 0b1);
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int opc = (((iw >> 23) & 0b1) << 2) | ((iw >> 20) & 0b11);
+    unsigned int op = (iw >> 6) & 0b1;
+    unsigned int addr, offset;
+    float *s = (float *) state->ext;
+
+    /* VLDR/VSTR */
+    if((iw & 0x0F200F00) == 0x0D000A00)
+    {
+        offset = (iw & 0xFF) << 2;
+        addr = ((iw >> 23) & 0b1) ? state->regs[rn] + offset : state->regs[rn] - offset;
+        simulate_cache(state->dmc, addr, state->regs[PC], state->total_inst_count);
+        heatmap_access(state, addr);
+
+        if((iw >> 20) & 0b1)
+        {
+            state->ext[sd] = *((unsigned int *) mmu_translate_range(state, addr, 4, MMU_READ));
+        }
+        else
+        {
+            *((unsigned int *) mmu_translate_range(state, addr, 4, MMU_WRITE)) = state->ext[sd];
+        }
+        return;
+    }
+
+    /* VDUP */
+    if((iw & 0x0F900F5F) == 0x0E800B10)
+    {
+        armemu_vdup(state, iw);
+        return;
+    }
+
+    /* VMOV between a core register and a single-precision register */
+    if((iw & 0x0FE00F7F) == 0x0E000A10)
+    {
+        if((iw >> 20) & 0b1)
+        {
+            state->regs[(iw >> 12) & 0xF] = state->ext[sn];
+        }
+        else
+        {
+            state->ext[sn] = state->regs[(iw >> 12) & 0xF];
+        }
+        return;
+    }
+
+    /* Only single precision data processing is supported */
+    if((iw & 0x0F000F10) != 0x0E000A00)
+    {
+        return;
+    }
+
+    switch(opc)
+    {
+        case 0b000:
+            s[sd] = op ? s[sd] - s[sn] * s[sm] : s[sd] + s[sn] * s[sm];
+            break;
+        case 0b010:
+            if(op == 0)
+            {
+                s[sd] = s[sn] * s[sm];
+            }
+            break;
+        case 0b011:
+            s[sd] = op ? s[sn] - s[sm] : s[sn] + s[sm];
+            break;
+        case 0b100:
+            if(op == 0)
+            {
+                s[sd] = s[sn] / s[sm];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*-------- Atomics -------- */
+
+/* The exclusive monitor is lock free: ldrex remembers the value it read
+ * and strex only succeeds if a host compare-and-swap finds that value
+ * still in memory. A store of the same value in between (ABA) is not
+ * detected, which is weaker than the architecture but enough for the
+ * usual retry loops. */
+void armemu_ldrex(struct arm_state *state, unsigned int iw)
+{
+    unsigned int rt = (iw >> 12) & 0xF;
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int addr = state->regs[rn];
+
+    simulate_cache(state->dmc, addr, state->regs[PC], state->total_inst_count);
+    heatmap_access(state, addr);
+
+    state->regs[rt] = __atomic_load_n((unsigned int *) mmu_translate_range(state, addr, 4, MMU_READ),
+                                      __ATOMIC_ACQUIRE);
+    state->excl_valid = true;
+    state->excl_addr = addr;
+    state->excl_val = state->regs[rt];
+
+    shift_pc(state, 4);
+    incrementMemoryCount(state);
+}
+
+void armemu_strex(struct arm_state *state, unsigned int iw)
+{
+    unsigned int rd = (iw >> 12) & 0xF;
+    unsigned int rn = (iw >> 16) & 0xF;
+    unsigned int rt = iw & 0xF;
+    unsigned int addr = state->regs[rn];
+    unsigned int expected = state->excl_val;
+    bool stored = false;
+
+    simulate_cache(state->dmc, addr, state->regs[PC], state->total_inst_count);
+    heatmap_access(state, addr);
+
+    if(state->excl_valid && state->excl_addr == addr)
+    {
+        stored = __atomic_compare_exchange_n((unsigned int *) mmu_translate_range(state, addr, 4, MMU_WRITE),
+                                             &expected, state->regs[rt],
+                                             false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    /* 0 on success, 1 if the guest has to retry */
+    state->regs[rd] = stored ? 0 : 1;
+    state->excl_valid = false;
+
+    shift_pc(state, 4);
+    incrementMemoryCount(state);
+}
+
+void armemu_dmb(struct arm_state *state)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    shift_pc(state, 4);
+    incrementMemoryCount(state);
+}
+
+void armemu_one(struct arm_state *state)
+{
+    unsigned int iw, pc;
+    enum inst_class class = CLASS_DP;
+    unsigned long long misses = state->dmc->misses;
+    
+    pc = state->regs[PC];
+    iw = *((unsigned int *) mmu_translate_range(state, pc, 4, MMU_EXEC));
+
+    if(is_bx_inst(iw))
+    {
+        class = CLASS_BRANCH;
+        armemu_bx(state);
+    }
+    else if(is_ldrex_inst(iw))
+    {
+        class = CLASS_MEM;
+        armemu_ldrex(state, iw);
+    }
+    else if(is_strex_inst(iw))
+    {
+        class = CLASS_MEM;
+        armemu_strex(state, iw);
+    }
+    else if(is_dmb_inst(iw))
+    {
+        class = CLASS_MEM;
+        armemu_dmb(state);
+    }
+    else if(is_semihost_inst(iw))
+    {
+        armemu_semihost(state);
+        shift_pc(state, 4);
+        incrementDataProcessingCount(state);
+    }
+    else if(is_neon_inst(iw))
+    {
+        if((iw >> 24) == 0xF4)
+        {
+            class = CLASS_MEM;
+            armemu_simd_mem(state, iw);
+            incrementMemoryCount(state);
+        }
+        else
+        {
+            armemu_simd_dp(state, iw);
+            incrementDataProcessingCount(state);
+        }
+        shift_pc(state, 4);
+    }
+    else if(is_vfp_inst(iw))
+    {
+        if((iw & 0x0F200F00) == 0x0D000A00)
+        {
+            class = CLASS_MEM;
+            armemu_vfp(state, iw);
+            incrementMemoryCount(state);
+        }
+        else
+        {
+            armemu_vfp(state, iw);
+            incrementDataProcessingCount(state);
+        }
+        shift_pc(state, 4);
+    }
+    else if(is_mul_inst(iw))
+    {
+        class = CLASS_MUL;
+        armemu_mul(state);
+    }
+    else if(is_mem_inst(iw))
+    {
+        class = CLASS_MEM;
+        armemu_mem(state);
+    }
+    else if(is_dp_inst(iw))
+    {
+        armemu_dp(state);
+    }
+    else if(is_b_inst(iw))
+    {
+        class = CLASS_BRANCH;
+        if(is_condition(state))
+        {
+            armemu_b(state);
+        }
+        else
+        {
+            state->regs[PC] = state->regs[PC] + 4;
+            state->branch_not_taken = state->branch_not_taken + 1;
+        }
+        incrementBranchCount(state);
+    }
+
+    if(class == CLASS_BRANCH)
+    {
+        branch_unit_update(state, iw, pc);
+        if(state->prof != NULL)
+        {
+            loop_profile_branch(state->prof, state->regs[PC]);
+        }
+    }
+
+    timing_account(state, iw, class, pc, state->dmc->misses - misses);
+}
+
+void fault_print(struct arm_state *state)
+{
+    switch(state->fault)
+    {
+        case FAULT_STACK_OVERFLOW:
+            fprintf(stderr, "Guest stack overflow: access to 0x%X at pc 0x%X, sp 0x%X (stack size %zu)\n",
+                    state->fault_addr, state->regs[PC], state->regs[SP], state->stack_size);
+            break;
+        case FAULT_DATA_ABORT:
+            fprintf(stderr, "Guest data abort: %s of 0x%X at pc 0x%X\n",
+                    state->fault_access == MMU_WRITE ? "write" : "read", state->fault_addr, state->regs[PC]);
+            break;
+        case FAULT_PREFETCH_ABORT:
+            fprintf(stderr, "Guest prefetch abort: fetch from 0x%X\n", state->fault_addr);
+            break;
+        case FAULT_UNDEFINED:
+            fprintf(stderr, "Guest undefined instruction 0x%08X at pc 0x%X\n",
+                    *((unsigned int *) state->fault_addr), state->fault_addr);
+            break;
+        default:
+            break;
+    }
+}
+
+unsigned int armemu(struct arm_state *state)
+{
+    /* A guest fault unwinds back here */
+    current_state = state;
+    if(sigsetjmp(fault_jmp, 1) != 0)
+    {
+        current_state = NULL;
+        if(state->sh != NULL)
+        {
+            semihost_flush(state->sh);
+        }
+        fault_print(state);
+        if(state->stats != NULL)
+        {
+            stats_publish(state);
+        }
+        return 0;
+    }
+
+    /* Execute instructions until PC = 0 */
+    /* This happens when bx lr is issued and lr is 0 */
+    while(state->regs[PC] != 0)
+    {
+        armemu_one(state);
+
+        if(state->total_inst_count >= state->next_event)
+        {
+            armemu_events(state);
+        }
+    }
+
+    current_state = NULL;
+
+    /* Publish the totals of the run */
+    if(state->stats != NULL)
+    {
+        stats_publish(state);
+    }
+
+    /* Guest output is only batched within a run */
+    if(state->sh != NULL)
+    {
+        semihost_flush(state->sh);
+    }
+
+    return state->regs[0];
+} 
+
+/*-------- Loop Profile -------- */
+
+/* Profiles come from analyze -o: a function line, then block and loop
+ * lines with byte offsets from the start of the function */
+
+int hot_loop_compare(const void *a, const void *b)
+{
+    const struct hot_loop *la = a, *lb = b;
+
+    return (la->header > lb->header) - (la->header < lb->header);
+}
+
+int loop_profile_load(struct loop_profile *prof, char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[CFG_LINE_LEN];
+    unsigned int start, end;
+    struct hot_loop *loop;
+    int i;
+
+    if(f == NULL)
+    {
+        return -1;
+    }
+
+    prof->function[0] = '\0';
+    prof->base = 0;
+    prof->end = 0;
+    prof->active = false;
+    prof->nblocks = 0;
+    prof->nloops = 0;
+
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        if(sscanf(line, "function %63s", prof->function) == 1)
+        {
+            for(i = 0; i < NUM_FUNCTIONS; i++)
+            {
+                if(strcmp(functions[i].name, prof->function) == 0)
+                {
+                    prof->base = (unsigned int) functions[i].addr;
+                }
+            }
+        }
+        else if(sscanf(line, "block %u %u", &start, &end) == 2 && prof->nblocks < MAX_BLOCKS)
+        {
+            prof->blocks[prof->nblocks++] = prof->base + start;
+            if(prof->base + end + 4 > prof->end)
+            {
+                prof->end = prof->base + end + 4;
+            }
+        }
+        else if(prof->nloops < MAX_LOOPS)
+        {
+            loop = &prof->loops[prof->nloops];
+            if(sscanf(line, "loop %u %d %d", &start, &loop->depth, &loop->nblocks) == 3)
+            {
+                loop->header = prof->base + start;
+                loop->count = 0;
+                prof->nloops++;
+            }
+        }
+    }
+
+    fclose(f);
+
+    /* The function must be one this build can run */
+    if(prof->base == 0)
+    {
+        return -1;
+    }
+
+    qsort(prof->loops, prof->nloops, sizeof(struct hot_loop), hot_loop_compare);
+
+    return 0;
+}
+
+/* Start counting when a run enters the profiled function */
+void loop_profile_reset(struct loop_profile *prof, unsigned int entry)
+{
+    int i;
+
+    prof->active = (entry == prof->base);
+    for(i = 0; i < prof->nloops; i++)
+    {
+        prof->loops[i].count = 0;
+    }
+}
+
+/* Every loop iteration ends with a branch back to the header, so only
+ * branch targets inside the function need to be looked up */
+void loop_profile_branch(struct loop_profile *prof, unsigned int target)
+{
+    int lo = 0, hi = prof->nloops - 1, mid;
+
+    /* Only the profiled function's own runs are counted */
+    if(!prof->active || target - prof->base >= prof->end - prof->base)
+    {
+        return;
+    }
+
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if(prof->loops[mid].header == target)
+        {
+            prof->loops[mid].count++;
+            return;
+        }
+        if(prof->loops[mid].header < target)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+}
+
+/*-------- Mapped Input -------- */
+
+/* Open an input file to map into the guest address space. Guest
+ * addresses are host addresses, so a mapping is used in place with no
+ * copy. A 32-bit host cannot map a multi-gigabyte file at once, so it
+ * is mapped INPUT_WINDOW bytes at a time with map_window. */
+int map_input(struct mapped_input *in)
+{
+    struct stat st;
+
+    in->fd = open(in->path, O_RDONLY);
+    if(in->fd < 0)
+    {
+        return -1;
+    }
+
+    if(fstat(in->fd, &st) < 0 || st.st_size == 0)
+    {
+        close(in->fd);
+        return -1;
+    }
+
+    in->size = st.st_size;
+    in->addr = NULL;
+    in->len = 0;
+
+    return map_window(in, 0);
+}
+
+/* Replace the current window with the one at offset. A read-only
+ * mapping faults on guest stores; a private mapping gives the guest
+ * copy-on-write pages instead. */
+int map_window(struct mapped_input *in, off_t offset)
+{
+    if(in->addr != NULL)
+    {
+        munmap(in->addr, in->len);
+        in->addr = NULL;
+    }
+
+    in->offset = offset;
+    in->len = in->size - offset < INPUT_WINDOW ? in->size - offset : INPUT_WINDOW;
+    in->addr = mmap(NULL, in->len, in->readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, in->fd, offset);
+    if(in->addr == MAP_FAILED)
+    {
+        in->addr = NULL;
+        return -1;
+    }
+
+    /* The kernels stream through the data once */
+    madvise(in->addr, in->len, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+void unmap_input(struct mapped_input *in)
+{
+    if(in->addr != NULL)
+    {
+        munmap(in->addr, in->len);
+    }
+    close(in->fd);
+}
+
+/*-------- Assembler -------- */
+
+/* Condition code suffixes in encoding order */
+char *cond_names[] = {"eq", "ne", "cs", "cc", "mi", "pl", "vs", "vc",
+                      "hi", "ls", "ge", "lt", "gt", "le", "al"};
+
+/* Mnemonics the assembler accepts, longest first where one is a prefix of another */
+char *asm_mnemonics[] = {"ldrex", "strex", "ldrb", "strb", "ldr", "str", "add", "sub",
+                         "mov", "cmp", "mul", "dmb", "svc", "bx", "bl", "b",
+                         "vld1", "vst1", "vldr", "vstr", "vdup", "vmov", "vadd", "vsub",
+                         "vmul", "vmla", "vmls", "vmax", "vmin", "vdiv"};
+
+#define NUM_MNEMONICS ((int) (sizeof(asm_mnemonics) / sizeof(asm_mnemonics[0])))
+
+/* The vector arithmetic the emulator executes */
+struct asm_vop asm_vops[] = {
+    {"vadd", 0xF2000800, 0xF2000D00, 0x0E300A00},
+    {"vsub", 0xF3000800, 0xF2200D00, 0x0E300A40},
+    {"vmul", 0xF2000910, 0xF3000D10, 0x0E200A00},
+    {"vmla", 0xF2000900, 0xF2000D10, 0x0E000A00},
+    {"vmls", 0xF3000900, 0xF2200D10, 0x0E000A40},
+    {"vmax", 0xF2000600, 0xF2000F00, 0},
+    {"vmin", 0xF2000610, 0xF2200F00, 0},
+    {"vdiv", 0, 0, 0x0E800A00},
+};
+
+#define NUM_VOPS ((int) (sizeof(asm_vops) / sizeof(asm_vops[0])))
+
+void asm_init(struct assembler *as)
+{
+    as->nfiles = 0;
+    as->nsymbols = 0;
+    as->code = NULL;
+    as->ncode = 0;
+}
+
+int asm_error(struct assembler *as, int file, int lineno, char *msg, char *arg)
+{
+    fprintf(stderr, "%s:%d: error: %s '%s'\n", as->names[file], lineno, msg, arg);
+    return -1;
+}
+
+/* Add source text to assemble under the given name */
+int asm_add_source(struct assembler *as, char *name, char *text)
+{
+    if(as->nfiles == MAX_ASM_FILES)
+    {
+        return -1;
+    }
+
+    as->names[as->nfiles] = name;
+    as->sources[as->nfiles] = text;
+    as->nfiles++;
+
+    return 0;
+}
+
+/* Read a whole .s file into memory and add it */
+int asm_add_file(struct assembler *as, char *path)
+{
+    FILE *f = fopen(path, "r");
+    char *text;
+    long len;
+
+    if(f == NULL)
+    {
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    text = (char *)malloc(len + 1);
+    len = fread(text, 1, len, f);
+    text[len] = '\0';
+    fclose(f);
+
+    return asm_add_source(as, path, text);
+}
+
+/* Find a symbol defined in file, or failing that a global one from any file */
+struct symbol *asm_lookup(struct assembler *as, int file, char *name)
+{
+    int i;
+
+    for(i = 0; i < as->nsymbols; i++)
+    {
+        if(as->symbols[i].file == file && as->symbols[i].defined
+           && strcmp(as->symbols[i].name, name) == 0)
+        {
+            return &as->symbols[i];
+        }
+    }
+    for(i = 0; i < as->nsymbols; i++)
+    {
+        if(as->symbols[i].global && as->symbols[i].defined && strcmp(as->symbols[i].name, name) == 0)
+        {
+            return &as->symbols[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Find or create the symbol name local to file */
+struct symbol *asm_symbol(struct assembler *as, int file, char *name)
+{
+    struct symbol *sym;
+    int i;
+
+    for(i = 0; i < as->nsymbols; i++)
+    {
+        if(as->symbols[i].file == file && strcmp(as->symbols[i].name, name) == 0)
+        {
+            return &as->symbols[i];
+        }
+    }
+
+    if(as->nsymbols == MAX_SYMBOLS || strlen(name) >= SYMBOL_LEN)
+    {
+        return NULL;
+    }
+
+    sym = &as->symbols[as->nsymbols++];
+    strcpy(sym->name, name);
+    sym->file = file;
+    sym->global = false;
+    sym->defined = false;
+    sym->addr = 0;
+
+    return sym;
+}
+
+/* Address of a global symbol after assembly, 0 if there is none */
+unsigned int asm_global(struct assembler *as, char *name)
+{
+    int i;
+
+    for(i = 0; i < as->nsymbols; i++)
+    {
+        if(as->symbols[i].global && as->symbols[i].defined
+           && (name == NULL || strcmp(as->symbols[i].name, name) == 0))
+        {
+            return as->symbols[i].addr;
+        }
+    }
+
+    return 0;
+}
+
+char *asm_skip_space(char *p)
+{
+    while(*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    return p;
+}
+
+/* Split operands on commas outside brackets and braces, trimming spaces. Returns the
+ * number of operands or -1 if there are too many. */
+int asm_split(char *p, char **ops)
+{
+    int n = 0, depth = 0;
+    char *end;
+
+    p = asm_skip_space(p);
+    if(*p == '\0')
+    {
+        return 0;
+    }
+
+    ops[n++] = p;
+    for(; *p != '\0'; p++)
+    {
+        if(*p == '[' || *p == '{')
+        {
+            depth++;
+        }
+        else if(*p == ']' || *p == '}')
+        {
+            depth--;
+        }
+        else if(*p == ',' && depth == 0)
+        {
+            if(n == MAX_OPERANDS)
+            {
+                return -1;
+            }
+            *p = '\0';
+            ops[n++] = asm_skip_space(p + 1);
+        }
+    }
+
+    /* Trim trailing spaces of each operand */
+    for(depth = 0; depth < n; depth++)
+    {
+        end = ops[depth] + strlen(ops[depth]);
+        while(end > ops[depth] && (end[-1] == ' ' || end[-1] == '\t'))
+        {
+            *--end = '\0';
+        }
+    }
+
+    return n;
+}
+
+int asm_reg(char *s)
+{
+    char *end;
+    long r;
+
+    if(strcmp(s, "sp") == 0)
+    {
+        return SP;
+    }
+    if(strcmp(s, "lr") == 0)
+    {
+        return LR;
+    }
+    if(strcmp(s, "pc") == 0)
+    {
+        return PC;
+    }
+    if(strcmp(s, "ip") == 0)
+    {
+        return 12;
+    }
+    if(strcmp(s, "fp") == 0)
+    {
+        return 11;
+    }
+    if(s[0] != 'r')
+    {
+        return -1;
+    }
+
+    r = strtol(s + 1, &end, 10);
+    if(end == s + 1 || *end != '\0' || r < 0 || r >= NREGS)
+    {
+        return -1;
+    }
+
+    return r;
+}
+
+/* Parse #imm into val */
+bool asm_imm(char *s, int *val)
+{
+    char *end;
+
+    if(s[0] != '#')
+    {
+        return false;
+    }
+
+    *val = strtol(s + 1, &end, 0);
+
+    return end != s + 1 && *end == '\0';
+}
+
+/* Encode an immediate as an 8-bit value rotated right by an even amount */
+int asm_rotated_imm(unsigned int val)
+{
+    int rot;
+
+    for(rot = 0; rot < 16; rot++)
+    {
+        unsigned int v = (val << (2 * rot)) | (rot ? val >> (32 - 2 * rot) : 0);
+        if(v <= 0xFF)
+        {
+            return (rot << 8) | v;
+        }
+    }
+
+    return -1;
+}
+
+/* Encode a register or immediate second operand */
+int asm_operand2(char *s, unsigned int *bits)
+{
+    int val, imm, rm;
+
+    if(asm_imm(s, &val))
+    {
+        imm = asm_rotated_imm(val);
+        if(imm < 0)
+        {
+            return -1;
+        }
+        *bits = (1 << 25) | imm;
+        return 0;
+    }
+
+    rm = asm_reg(s);
+    if(rm < 0)
+    {
+        return -1;
     }
+    *bits = rm;
+
+    return 0;
 }
 
-void armemu_mov(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+/* Encode an [rn], [rn, #imm] or [rn, rm] address */
+int asm_address(char *s, unsigned int *bits)
 {
-    unsigned int rm;
+    char *ops[MAX_OPERANDS];
+    char buf[64];
+    int n, rn, rm, val;
+    int len = strlen(s);
 
-    if(is_imm(iw))
+    if(s[0] != '[' || s[len - 1] != ']' || len >= (int) sizeof(buf))
+    {
+        return -1;
+    }
+
+    strncpy(buf, s + 1, len - 2);
+    buf[len - 2] = '\0';
+
+    n = asm_split(buf, ops);
+    if(n < 1 || n > 2 || (rn = asm_reg(ops[0])) < 0)
+    {
+        return -1;
+    }
+
+    /* Pre-indexed, offset added */
+    *bits = (1 << 24) | (1 << 23) | (rn << 16);
+
+    if(n == 2)
+    {
+        if(asm_imm(ops[1], &val))
+        {
+            if(val < 0)
+            {
+                *bits &= ~(1 << 23);
+                val = -val;
+            }
+            if(val > 0xFFF)
+            {
+                return -1;
+            }
+            *bits |= val;
+        }
+        else if((rm = asm_reg(ops[1])) >= 0)
+        {
+            *bits |= (1 << 25) | rm;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Split a mnemonic like "bleq" into its index in asm_mnemonics and a condition */
+int asm_mnemonic(char *s, unsigned int *cond)
+{
+    int i, c, len;
+
+    for(i = 0; i < NUM_MNEMONICS; i++)
+    {
+        len = strlen(asm_mnemonics[i]);
+        if(strncmp(s, asm_mnemonics[i], len) != 0)
+        {
+            continue;
+        }
+        if(s[len] == '\0')
+        {
+            *cond = 0b1110;
+            return i;
+        }
+        for(c = 0; c < 15; c++)
+        {
+            if(strcmp(s + len, cond_names[c]) == 0)
+            {
+                *cond = c;
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* Parse a VFP/NEON register: s0-s31, d0-d31 or q0-q15. Returns the
+ * number and sets kind to its letter, or -1. */
+int asm_vreg(char *s, char *kind)
+{
+    char *end;
+    long r;
+
+    if(s[0] != 's' && s[0] != 'd' && s[0] != 'q')
+    {
+        return -1;
+    }
+
+    r = strtol(s + 1, &end, 10);
+    if(end == s + 1 || *end != '\0' || r < 0 || r >= (s[0] == 'q' ? 16 : 32))
+    {
+        return -1;
+    }
+
+    *kind = s[0];
+    return r;
+}
+
+/* Place register r in a VFP/NEON register field: the low four bits at
+ * shift and the remaining bit at bit. S registers keep the odd bit apart,
+ * D registers the high one. */
+unsigned int asm_vfield(int r, char kind, int shift, int bit)
+{
+    if(kind == 's')
+    {
+        return ((r >> 1) << shift) | ((r & 1) << bit);
+    }
+
+    return ((r & 0xF) << shift) | ((r >> 4) << bit);
+}
+
+/* Parse a data type suffix such as i32, s16, f32 or 8 into its letter
+ * (0 if there is none) and the size field for 8, 16, 32 and 64 bits */
+int asm_vtype(char *type, char *kind, unsigned int *size)
+{
+    char *end;
+    long bits;
+
+    if(type == NULL)
+    {
+        return -1;
+    }
+
+    *kind = 0;
+    if(*type == 'i' || *type == 's' || *type == 'u' || *type == 'f')
+    {
+        *kind = *type++;
+    }
+
+    bits = strtol(type, &end, 10);
+    if(end == type || *end != '\0')
+    {
+        return -1;
+    }
+
+    switch(bits)
+    {
+        case 8:
+            *size = 0;
+            break;
+        case 16:
+            *size = 1;
+            break;
+        case 32:
+            *size = 2;
+            break;
+        case 64:
+            *size = 3;
+            break;
+        default:
+            return -1;
+    }
+
+    return *kind == 'f' && bits != 32 ? -1 : 0;
+}
+
+/* Parse a VLD1/VST1 list of 1 to 4 consecutive D registers, written as
+ * {d0, d1}, {d0-d3} or {q0}. Returns the first register and sets count. */
+int asm_vlist(char *s, int *count)
+{
+    char *ops[MAX_OPERANDS];
+    char buf[64];
+    char kind;
+    int i, n, first = -1, next = 0, r, last;
+    int len = strlen(s);
+    char *dash;
+
+    if(s[0] != '{' || s[len - 1] != '}' || len >= (int) sizeof(buf))
+    {
+        return -1;
+    }
+
+    strncpy(buf, s + 1, len - 2);
+    buf[len - 2] = '\0';
+
+    n = asm_split(buf, ops);
+    *count = 0;
+    for(i = 0; i < n; i++)
+    {
+        dash = strchr(ops[i], '-');
+        if(dash != NULL)
+        {
+            *dash = '\0';
+        }
+
+        r = asm_vreg(ops[i], &kind);
+        if(r < 0 || kind == 's')
+        {
+            return -1;
+        }
+        if(kind == 'q')
+        {
+            r *= 2;
+        }
+        last = kind == 'q' ? r + 1 : r;
+
+        if(dash != NULL)
+        {
+            if(kind != 'd' || (last = asm_vreg(dash + 1, &kind)) < r || kind != 'd')
+            {
+                return -1;
+            }
+        }
+
+        if(first >= 0 && r != next)
+        {
+            return -1;
+        }
+        if(first < 0)
+        {
+            first = r;
+        }
+        *count += last - r + 1;
+        next = last + 1;
+    }
+
+    return *count >= 1 && *count <= 4 && next <= 32 ? first : -1;
+}
+
+/* Encode a VFP or Advanced SIMD instruction. NEON instructions are
+ * unconditional; the VFP ones take a condition like the core ones. */
+int asm_encode_vector(struct assembler *as, int file, int lineno, char *mnemonic, char *m,
+                      char *type, unsigned int cond, char **ops, int n, unsigned int *iw)
+{
+    unsigned int list_types[] = {0b0111, 0b1010, 0b0110, 0b0010};
+    char kind, dkind, nkind, mkind;
+    unsigned int size, bits;
+    int i, rd, rn, rm, count;
+    int len;
+
+    if(strcmp(m, "vld1") == 0 || strcmp(m, "vst1") == 0)
+    {
+        if(cond != 0b1110)
+        {
+            return asm_error(as, file, lineno, "instruction cannot be conditional", mnemonic);
+        }
+        if(asm_vtype(type, &kind, &size) < 0 || (n != 2 && n != 3)
+           || (rd = asm_vlist(ops[0], &count)) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+
+        /* [rn] without writeback, [rn]! adds the transfer size and
+         * [rn], rm adds a register */
+        len = strlen(ops[1]);
+        rm = PC;
+        if(len > 0 && ops[1][len - 1] == '!')
+        {
+            ops[1][--len] = '\0';
+            rm = SP;
+        }
+        if(len < 3 || ops[1][0] != '[' || ops[1][len - 1] != ']' || (n == 3 && rm == SP))
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        ops[1][len - 1] = '\0';
+        rn = asm_reg(ops[1] + 1);
+        if(n == 3)
+        {
+            rm = asm_reg(ops[2]);
+        }
+        if(rn < 0 || rn == PC || rm < 0 || (n == 3 && (rm == SP || rm == PC)))
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+
+        *iw = 0xF4000000 | asm_vfield(rd, 'd', 12, 22) | (rn << 16)
+            | (list_types[count - 1] << 8) | (size << 6) | rm;
+        if(m[1] == 'l')
+        {
+            *iw |= 1 << 21;
+        }
+        return 0;
+    }
+
+    if(strcmp(m, "vldr") == 0 || strcmp(m, "vstr") == 0)
+    {
+        /* Single precision only, the offset is in words */
+        if(n != 2 || asm_vreg(ops[0], &kind) < 0 || kind != 's'
+           || asm_address(ops[1], &bits) < 0 || (bits & (1 << 25)) != 0
+           || (bits & 0xFFF) > 1020 || (bits & 0b11) != 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        rd = asm_vreg(ops[0], &kind);
+        *iw = (cond << 28) | 0x0D000A00 | (bits & ((1 << 23) | (0xF << 16)))
+            | asm_vfield(rd, 's', 12, 22) | ((bits & 0xFFF) >> 2);
+        if(m[1] == 'l')
+        {
+            *iw |= 1 << 20;
+        }
+        return 0;
+    }
+
+    if(strcmp(m, "vdup") == 0)
+    {
+        if(asm_vtype(type, &kind, &size) < 0 || size > 2 || n != 2
+           || (rd = asm_vreg(ops[0], &dkind)) < 0 || dkind == 's'
+           || (rn = asm_reg(ops[1])) < 0 || rn == PC)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        if(dkind == 'q')
+        {
+            rd *= 2;
+        }
+        *iw = (cond << 28) | 0x0E800B10 | asm_vfield(rd, 'd', 16, 7) | (rn << 12);
+        if(dkind == 'q')
+        {
+            *iw |= 1 << 21;
+        }
+        if(size == 0)
+        {
+            *iw |= 1 << 22;
+        }
+        else if(size == 1)
+        {
+            *iw |= 1 << 5;
+        }
+        return 0;
+    }
+
+    if(strcmp(m, "vmov") == 0)
+    {
+        /* Between a core register and a single-precision register */
+        if(n != 2)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        if((rd = asm_reg(ops[0])) >= 0 && (rn = asm_vreg(ops[1], &kind)) >= 0 && kind == 's')
+        {
+            *iw = (cond << 28) | 0x0E100A10 | asm_vfield(rn, 's', 16, 7) | (rd << 12);
+        }
+        else if((rn = asm_vreg(ops[0], &kind)) >= 0 && kind == 's' && (rd = asm_reg(ops[1])) >= 0)
+        {
+            *iw = (cond << 28) | 0x0E000A10 | asm_vfield(rn, 's', 16, 7) | (rd << 12);
+        }
+        else
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        if(rd == PC)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        return 0;
+    }
+
+    /* Three-register arithmetic */
+    for(i = 0; i < NUM_VOPS && strcmp(asm_vops[i].name, m) != 0; i++)
+    {
+    }
+    if(i == NUM_VOPS || asm_vtype(type, &kind, &size) < 0 || n != 3
+       || (rd = asm_vreg(ops[0], &dkind)) < 0 || (rn = asm_vreg(ops[1], &nkind)) < 0
+       || (rm = asm_vreg(ops[2], &mkind)) < 0 || dkind != nkind || dkind != mkind)
+    {
+        return asm_error(as, file, lineno, "bad operands for", mnemonic);
+    }
+
+    if(dkind == 's')
+    {
+        if(kind != 'f' || asm_vops[i].vfp == 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | asm_vops[i].vfp | asm_vfield(rd, 's', 12, 22)
+            | asm_vfield(rn, 's', 16, 7) | asm_vfield(rm, 's', 0, 5);
+        return 0;
+    }
+
+    if(cond != 0b1110)
+    {
+        return asm_error(as, file, lineno, "instruction cannot be conditional", mnemonic);
+    }
+
+    if(kind == 'f')
+    {
+        bits = asm_vops[i].simd_float;
+    }
+    else
+    {
+        bits = asm_vops[i].simd_int | (size << 20);
+
+        /* VMAX/VMIN need the signedness, the rest are sign agnostic */
+        if(((bits >> 8) & 0xF) == 0b0110)
+        {
+            if(kind != 's' && kind != 'u')
+            {
+                bits = 0;
+            }
+            else if(kind == 'u')
+            {
+                bits |= 1 << 24;
+            }
+        }
+        if(size > 2 || kind == 0)
+        {
+            bits = 0;
+        }
+    }
+    if(asm_vops[i].simd_int == 0 || bits == 0)
+    {
+        return asm_error(as, file, lineno, "bad operands for", mnemonic);
+    }
+
+    if(dkind == 'q')
+    {
+        rd *= 2;
+        rn *= 2;
+        rm *= 2;
+        bits |= 1 << 6;
+    }
+    *iw = bits | asm_vfield(rd, 'd', 12, 22) | asm_vfield(rn, 'd', 16, 7) | asm_vfield(rm, 'd', 0, 5);
+
+    return 0;
+}
+
+/* Encode one instruction at address pc */
+int asm_encode(struct assembler *as, int file, int lineno, char *mnemonic, char *operands,
+               unsigned int pc, unsigned int *iw)
+{
+    char *ops[MAX_OPERANDS];
+    char *m, *type;
+    unsigned int cond, bits;
+    int n, rd, rn, rm, rs, val;
+    struct symbol *sym;
+    int index;
+
+    /* Split off a data type such as the .i32 of vadd.i32 */
+    type = strchr(mnemonic, '.');
+    if(type != NULL)
+    {
+        *type++ = '\0';
+    }
+
+    index = asm_mnemonic(mnemonic, &cond);
+    if(index < 0)
+    {
+        return asm_error(as, file, lineno, "unknown instruction", mnemonic);
+    }
+    m = asm_mnemonics[index];
+
+    n = asm_split(operands, ops);
+    if(n < 0)
+    {
+        return asm_error(as, file, lineno, "too many operands for", mnemonic);
+    }
+
+    if(m[0] == 'v')
+    {
+        return asm_encode_vector(as, file, lineno, mnemonic, m, type, cond, ops, n, iw);
+    }
+    if(type != NULL)
+    {
+        return asm_error(as, file, lineno, "unexpected data type for", mnemonic);
+    }
+
+    if(strcmp(m, "add") == 0 || strcmp(m, "sub") == 0)
+    {
+        if(n != 3 || (rd = asm_reg(ops[0])) < 0 || (rn = asm_reg(ops[1])) < 0
+           || asm_operand2(ops[2], &bits) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | ((m[0] == 'a' ? 0b0100 : 0b0010) << 21) | (rn << 16) | (rd << 12) | bits;
+    }
+    else if(strcmp(m, "mov") == 0)
+    {
+        if(n != 2 || (rd = asm_reg(ops[0])) < 0 || asm_operand2(ops[1], &bits) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | (0b1101 << 21) | (rd << 12) | bits;
+    }
+    else if(strcmp(m, "cmp") == 0)
+    {
+        if(n != 2 || (rn = asm_reg(ops[0])) < 0 || asm_operand2(ops[1], &bits) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | (0b1010 << 21) | (1 << 20) | (rn << 16) | bits;
+    }
+    else if(strcmp(m, "mul") == 0)
+    {
+        if(n != 3 || (rd = asm_reg(ops[0])) < 0 || (rm = asm_reg(ops[1])) < 0
+           || (rs = asm_reg(ops[2])) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | (rd << 16) | (rs << 8) | (0b1001 << 4) | rm;
+    }
+    else if(strcmp(m, "ldr") == 0 || strcmp(m, "str") == 0
+            || strcmp(m, "ldrb") == 0 || strcmp(m, "strb") == 0)
+    {
+        if(n != 2 || (rd = asm_reg(ops[0])) < 0 || asm_address(ops[1], &bits) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | (0b01 << 26) | bits | (rd << 12);
+        if(m[0] == 'l')
+        {
+            *iw |= 1 << 20;
+        }
+        if(m[3] == 'b')
+        {
+            *iw |= 1 << 22;
+        }
+    }
+    else if(strcmp(m, "ldrex") == 0)
+    {
+        if(n != 2 || (rd = asm_reg(ops[0])) < 0 || asm_address(ops[1], &bits) < 0
+           || (bits & 0xFFF) != 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | 0x01900F9F | (bits & (0xF << 16)) | (rd << 12);
+    }
+    else if(strcmp(m, "strex") == 0)
+    {
+        if(n != 3 || (rd = asm_reg(ops[0])) < 0 || (rm = asm_reg(ops[1])) < 0
+           || asm_address(ops[2], &bits) < 0 || (bits & 0xFFF) != 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | 0x01800F90 | (bits & (0xF << 16)) | (rd << 12) | rm;
+    }
+    else if(strcmp(m, "dmb") == 0)
+    {
+        /* Full system barrier whatever the option */
+        *iw = 0xF57FF05F;
+    }
+    else if(strcmp(m, "svc") == 0)
+    {
+        /* The # is optional on the comment field */
+        if(n == 1 && ops[0][0] != '#')
+        {
+            val = strtol(ops[0], &m, 0);
+            if(m == ops[0] || *m != '\0')
+            {
+                val = -1;
+            }
+        }
+        else if(n != 1 || !asm_imm(ops[0], &val))
+        {
+            val = -1;
+        }
+        if((val & ~0xFFFFFF) != 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | 0x0F000000 | val;
+    }
+    else if(strcmp(m, "bx") == 0)
     {
-        rn = iw & 0xFF;
-        state->regs[rd] = rn;
+        if(n != 1 || (rm = asm_reg(ops[0])) < 0)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        *iw = (cond << 28) | 0x012FFF10 | rm;
     }
     else
     {
-        rn = iw & 0xF;
-        state->regs[rd] = state->regs[rn];
+        /* b and bl */
+        if(n != 1)
+        {
+            return asm_error(as, file, lineno, "bad operands for", mnemonic);
+        }
+        sym = asm_lookup(as, file, ops[0]);
+        if(sym == NULL)
+        {
+            return asm_error(as, file, lineno, "undefined label", ops[0]);
+        }
+        *iw = (cond << 28) | (0b101 << 25) | (((sym->addr - (pc + 8)) >> 2) & 0xFFFFFF);
+        if(m[1] == 'l')
+        {
+            *iw |= 1 << 24;
+        }
     }
 
-    if(rd != PC)
-    {
-        shift_pc(state, 4);
-    }
+    return 0;
 }
 
-void armemu_cmp(struct arm_state *state, unsigned int iw, unsigned int rd, unsigned int rn)
+/* Assemble one source line. Labels and directives are handled in pass 1,
+ * instructions are counted in pass 1 and encoded in pass 2. Returns the
+ * number of instructions on the line or -1 on error. */
+int asm_line(struct assembler *as, int file, int lineno, char *line, int pass,
+             unsigned int pc, unsigned int *iw)
 {
-    int cmp, rm;
-
-    /* Reset CPSR value */
-    state->cpsr = 0;
+    struct symbol *sym;
+    char *p = asm_skip_space(line), *word, *colon;
 
-    if(is_imm(iw))
+    /* Leading labels */
+    while((colon = strchr(p, ':')) != NULL)
     {
-        rm = iw & 0xFF;
-        cmp = state->regs[rn] - rm;
+        *colon = '\0';
+        if(pass == 1)
+        {
+            sym = asm_symbol(as, file, p);
+            if(sym == NULL || sym->defined)
+            {
+                return asm_error(as, file, lineno, "bad or duplicate label", p);
+            }
+            sym->defined = true;
+            sym->addr = pc;
+        }
+        p = asm_skip_space(colon + 1);
     }
-    else
+
+    if(*p == '\0')
     {
-        rm = iw & 0xF;
-        cmp = state->regs[rn] - state->regs[rm];
+        return 0;
     }
 
-    /* Check comparision value and set cpsr*/
-    if(cmp == 0)
+    word = p;
+    while(*p != '\0' && *p != ' ' && *p != '\t')
     {
-        state->cpsr = 0;
+        p++;
     }
-    else if(cmp < 0)
+    if(*p != '\0')
     {
-        state->cpsr = (0b1011 << 28);
+        *p++ = '\0';
     }
-    else if(cmp > 0)
+
+    if(word[0] == '.')
     {
-        state->cpsr = (0b1100 << 28);
+        if(strcmp(word, ".global") == 0 || strcmp(word, ".globl") == 0)
+        {
+            if(pass == 1)
+            {
+                p = asm_skip_space(p);
+                sym = asm_symbol(as, file, p);
+                if(sym == NULL)
+                {
+                    return asm_error(as, file, lineno, "bad symbol", p);
+                }
+                sym->global = true;
+            }
+            return 0;
+        }
+        if(strcmp(word, ".func") == 0 || strcmp(word, ".endfunc") == 0
+           || strcmp(word, ".text") == 0 || strcmp(word, ".align") == 0)
+        {
+            return 0;
+        }
+        return asm_error(as, file, lineno, "unsupported directive", word);
     }
 
-    if(rd != PC)
+    if(pass == 2 && asm_encode(as, file, lineno, word, p, pc, iw) < 0)
     {
-        shift_pc(state, 4);
+        return -1;
     }
+
+    return 1;
 }
 
-void armemu_mul(struct arm_state *state)
+/* Run one pass over a source file. In pass 1 pc counts from 0, in pass 2
+ * it is the final address and the code is written there. */
+int asm_pass(struct assembler *as, int file, int pass, unsigned int pc)
 {
+    char line[ASM_LINE_LEN];
+    char *src = as->sources[file];
+    bool in_comment = false;
+    int lineno = 0, len, n, count = 0;
     unsigned int iw;
-    unsigned int rd, rn, rs;
-
-    iw = *((unsigned int *) state->regs[PC]);
 
-    rd = (iw >> 16) & 0xF;
-    rn = (iw >> 12) & 0xF;
-       rs = (iw >> 8) & 0xF;
+    while(*src != '\0')
+    {
+        lineno++;
 
-    state->regs[rd] = state->regs[rn] * state->regs[rs];
+        /* Copy the line, dropping comments and lowering case */
+        len = 0;
+        while(*src != '\0' && *src != '\n')
+        {
+            if(in_comment)
+            {
+                if(src[0] == '*' && src[1] == '/')
+                {
+                    in_comment = false;
+                    src++;
+                }
+            }
+            else if(src[0] == '/' && src[1] == '*')
+            {
+                in_comment = true;
+                src++;
+            }
+            else if((src[0] == '/' && src[1] == '/') || src[0] == '@')
+            {
+                while(src[1] != '\0' && src[1] != '\n')
+                {
+                    src++;
+                }
+            }
+            else if(len < ASM_LINE_LEN - 1)
+            {
+                line[len++] = (*src >= 'A' && *src <= 'Z') ? *src - 'A' + 'a' : *src;
+            }
+            src++;
+        }
+        while(len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t' || line[len - 1] == '\r'))
+        {
+            len--;
+        }
+        line[len] = '\0';
+        if(*src == '\n')
+        {
+            src++;
+        }
 
-    if(rd != PC)
-    {
-        shift_pc(state, 4);
+        n = asm_line(as, file, lineno, line, pass, pc, &iw);
+        if(n < 0)
+        {
+            return -1;
+        }
+        if(n > 0)
+        {
+            if(pass == 2)
+            {
+                *((unsigned int *) pc) = iw;
+            }
+            pc += 4;
+            count++;
+        }
     }
 
-    incrementDataProcessingCount(state);
+    return count;
 }
 
-/*---------- Branching Emulation Functions ----------*/
-
-void armemu_b(struct arm_state *state)
+/* Assemble every added source into one guest code buffer. Globals from
+ * any file can be branched to from the others. */
+int asm_assemble(struct assembler *as)
 {
-    unsigned int iw;
-    int offset;
+    unsigned int base[MAX_ASM_FILES];
+    int counts[MAX_ASM_FILES];
+    int i, f, total = 0;
 
-    iw = *((unsigned int *) state->regs[PC]);
-    
-    /* Check the link bit to see if branching with a link */
-    if((iw >> 24) & 0b1 == 1)
+    for(f = 0; f < as->nfiles; f++)
     {
-        state->regs[LR] = state->regs[PC] + 4;
+        counts[f] = asm_pass(as, f, 1, 0);
+        if(counts[f] < 0)
+        {
+            return -1;
+        }
+        total += counts[f];
     }
-    
-    /* Grabbing the offset from the first 24 bits */
-    offset = iw & 0xFFFFFF;
-    offset = offset << 2;
 
-    /* Shift to the end of the offset and check the value of its last bit 
-     * if it starts with 1, we know it is a 2's complement number */
-    if((iw >> 23) & 0b1 == 1)
+    /* The code gets pages of its own, so mapping them for the guest
+     * exposes nothing else of the host */
+    as->code = mmap(NULL, total * 4 + 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(as->code == MAP_FAILED)
     {
-        offset = offset | 0b111111 << 26;
-        offset = ~offset + 1;
-        offset = 0 - offset;
+        as->code = NULL;
+        return -1;
     }
+    as->ncode = total;
 
-    shift_pc(state, 8 + offset);
+    /* Lay the files out back to back and move their labels there */
+    base[0] = (unsigned int) as->code;
+    for(f = 1; f < as->nfiles; f++)
+    {
+        base[f] = base[f - 1] + counts[f - 1] * 4;
+    }
+    for(i = 0; i < as->nsymbols; i++)
+    {
+        as->symbols[i].addr += base[as->symbols[i].file];
+    }
 
-    state->branch_taken = state->branch_taken + 1;
+    for(f = 0; f < as->nfiles; f++)
+    {
+        if(asm_pass(as, f, 2, base[f]) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
-void armemu_bx(struct arm_state *state)
+/*-------- Multi-core -------- */
+
+/* Give a core its own cache, prefetcher, timing and branch prediction
+ * state, configured like proto. Counters are private to the core so the
+ * host threads never share a cache line on the hot path. */
+void arm_core_init(struct arm_state *core, struct arm_state *proto)
 {
-    unsigned int iw;
-    unsigned int rn;
+    int i;
 
-    iw = *((unsigned int *) state->regs[PC]);
-    rn = iw & 0b1111;
+    core->dmc = (struct cache *)malloc(sizeof(struct cache));
+    core->dmc->size = proto->dmc->size;
+    core->dmc->pf = (struct prefetcher *)malloc(sizeof(struct prefetcher));
+    core->dmc->pf->kind = proto->dmc->pf->kind;
+    struct_init(core->dmc);
+    prefetcher_init(core->dmc->pf);
 
-    state->regs[PC] = state->regs[rn];
+    if(arm_stack_alloc(core, proto->stack_size) != 0)
+    {
+        perror("Could not allocate a guest stack");
+        exit(1);
+    }
 
-    state->branch_taken = state->branch_taken + 1;
-    incrementBranchCount(state);
-}
+    core->sh = (struct semihost *)malloc(sizeof(struct semihost));
+    semihost_init(core->sh);
 
-/*-------- Caching -------- */
-int get_slot(int size, unsigned int address)
-{
-    return (address >> 2) & (size -1);
-}
+    core->bus = NULL;
+    core->bus_base = 0;
+    core->bus_size = 0;
+    core->prof = NULL;
+    core->heat = NULL;
+    core->mmu = NULL;
+    core->stats = NULL;
 
-unsigned int get_tag(int size, unsigned int address)
-{
-    int log2 = 0;
-    while(size)
+    core->tm = (struct timing *)malloc(sizeof(struct timing));
+    core->tm->model = proto->tm->model;
+
+    core->bpu = (struct branch_unit *)malloc(sizeof(struct branch_unit));
+    core->bpu->npreds = proto->bpu->npreds;
+    for(i = 0; i < proto->bpu->npreds; i++)
     {
-        size = size >> 1;
-        log2 = log2+1;
+        predictor_init(&core->bpu->preds[i], proto->bpu->preds[i].kind, proto->bpu->preds[i].bits);
     }
-
-    return (address >> (2 + log2)) & ((2+log2) - 1);
+    branch_unit_init(core->bpu);
 }
 
-unsigned int get_cache_vbit(struct cache * dmc, int slot)
+/* Release everything arm_core_init allocated */
+void arm_core_free(struct arm_state *core)
 {
-    return dmc->slots[slot].v;
+    int i;
+
+    for(i = 0; i < core->bpu->npreds; i++)
+    {
+        free(core->bpu->preds[i].counters);
+        free(core->bpu->preds[i].local);
+        free(core->bpu->preds[i].chooser);
+    }
+    free(core->bpu);
+    free(core->tm);
+    free(core->sh);
+    arm_stack_free(core);
+    free(core->dmc->slots);
+    free(core->dmc->pf);
+    free(core->dmc);
 }
-unsigned int get_cache_tag(struct cache * dmc, int slot)
+
+/* Add the counters of one core into total */
+void arm_state_merge(struct arm_state *total, struct arm_state *core)
 {
-    return dmc->slots[slot].tag;
+    int i;
+
+    total->branch_inst_count += core->branch_inst_count;
+    total->dp_inst_count += core->dp_inst_count;
+    total->mem_inst_count += core->mem_inst_count;
+    total->total_inst_count += core->total_inst_count;
+    total->branch_taken += core->branch_taken;
+    total->branch_not_taken += core->branch_not_taken;
+
+    total->dmc->hits += core->dmc->hits;
+    total->dmc->misses += core->dmc->misses;
+    total->dmc->requests += core->dmc->requests;
+    total->dmc->pf->issued += core->dmc->pf->issued;
+    total->dmc->pf->useful += core->dmc->pf->useful;
+    total->dmc->pf->late += core->dmc->pf->late;
+    total->dmc->pf->useless += core->dmc->pf->useless;
+
+    total->tm->cycles += core->tm->cycles;
+    total->tm->base_cycles += core->tm->base_cycles;
+    total->tm->load_use_stalls += core->tm->load_use_stalls;
+    total->tm->branch_stalls += core->tm->branch_stalls;
+    total->tm->cache_stalls += core->tm->cache_stalls;
+
+    for(i = 0; i < total->bpu->npreds; i++)
+    {
+        total->bpu->preds[i].predictions += core->bpu->preds[i].predictions;
+        total->bpu->preds[i].mispredicts += core->bpu->preds[i].mispredicts;
+    }
+    total->bpu->btb_hits += core->bpu->btb_hits;
+    total->bpu->btb_misses += core->bpu->btb_misses;
+    total->bpu->ras_hits += core->bpu->ras_hits;
+    total->bpu->ras_misses += core->bpu->ras_misses;
 }
 
-void update_cache(struct cache * dmc, int slot, unsigned int tag)
+void *armemu_thread(void *arg)
 {
-    dmc->slots[slot].tag = tag;
-    dmc->slots[slot].v = 1;
+    armemu((struct arm_state *) arg);
+
+    return NULL;
 }
 
-void simulate_cache(struct cache * dmc, unsigned int address)
+/* Run every core on its own host thread against the shared guest memory */
+void armemu_smp(struct arm_state *cores, int ncores)
 {
-    int slot = get_slot(dmc->size, address);
-    unsigned int tag = get_tag(dmc->size, address);
-    unsigned int v = get_cache_vbit(dmc, slot);
-    unsigned int tagc = get_cache_tag(dmc, slot);
+    pthread_t threads[MAX_CORES];
+    int i;
 
-    if(!v)
-    {
-        dmc->misses++;
-        update_cache(dmc, slot, tag);
-    }
-    else
+    for(i = 0; i < ncores; i++)
     {
-        if(tag == tagc)
-        {
-            dmc->hits++;
-        }
-        else
+        if(pthread_create(&threads[i], NULL, armemu_thread, &cores[i]) != 0)
         {
-            dmc->misses++;
-            update_cache(dmc, slot, tag);
+            perror("pthread_create");
+            exit(1);
         }
     }
-    dmc->requests++;
+
+    for(i = 0; i < ncores; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
 }
 
 
-/*-------- Primary Functions -------- */
+/*-------- Printing functions for testing and/or debugging ---------*/
 
-/* Function to execute a data processing instruction depending on the provided opcode */
-void armemu_dp(struct arm_state *state)
+void arm_state_print(struct arm_state *as)
 {
-    unsigned int rd, rn;
-    unsigned int iw = *((unsigned int *) state->regs[PC]);
-    unsigned int opcode = (iw >> 21) & 0b1111;
-
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
+    int i;
 
-    switch(opcode)
+    for(i = 0; i < NREGS; i++)
     {
-        case 0b0100:
-            armemu_add(state, iw, rd, rn);
-            break;
-        case 0b0010:
-            armemu_sub(state, iw, rd, rn);
-            break;
-        case 0b1010:
-            armemu_cmp(state, iw, rd, rn);
-            break;
-        case 0b1101:
-            armemu_mov(state, iw, rd, rn);
-            break;
-        default:
-            break;
+        printf("reg[%d] = %d\n", i, as->regs[i]);
     }
+    printf("cpsr = %X\n", as->cpsr);
+}
 
-    incrementDataProcessingCount(state);
+void cache_statistics_print(struct cache *dmc)
+{
+    printf("\nCache Statistics:\n");
+    printf("-----------------------------------\n");
+    printf("Hits: %llu (%.1f%%)\n", dmc->hits, (double) dmc->hits / dmc->requests * 100);
+    printf("Misses: %llu (%.1f%%)\n", dmc->misses, (double) dmc->misses / dmc->requests * 100);
+    printf("Requests: %llu\n", dmc->requests);
 }
 
-/* Function to execute commands such as str and ldr */
-void armemu_mem(struct arm_state *state)
+void prefetch_statistics_print(struct cache *dmc)
 {
-    unsigned int rd, rn, rm, val;
-    unsigned int iw = *((unsigned int *) state->regs[PC]);
-    int offset;
+    struct prefetcher *pf = dmc->pf;
 
-    rd = (iw >> 12) & 0xF;
-    rn = (iw >> 16) & 0xF;
+    printf("\nPrefetch Statistics (%s):\n", pf_kind_names[pf->kind]);
+    printf("-----------------------------------\n");
+    printf("Issued: %llu\n", pf->issued);
+    printf("Useful: %llu\n", pf->useful);
+    printf("Useless: %llu\n", pf->useless);
+    printf("Coverage: %.1f%%\n", pf->useful + dmc->misses == 0 ? 0 :
+           (double) pf->useful / (pf->useful + dmc->misses) * 100);
+    printf("Accuracy: %.1f%%\n", pf->issued == 0 ? 0 : (double) pf->useful / pf->issued * 100);
+    printf("Late: %llu (%.1f%%)\n", pf->late, pf->useful == 0 ? 0 : (double) pf->late / pf->useful * 100);
+}
 
-    /* if the value at this bit is 1, we know
-     * the offset is a register, so we set it accordingly */
-    if((iw >> 25) & 0b1 == 1)
-    {
-        rm = iw & 0xF;
-        offset = state->regs[rm];
-    }
-    /* Otherwise, retrieve the immediate value offset */
-    else
-    {
-        offset = iw & 0xFFF;
-    }
-    
-    /* Shift to the load/store bit & check whether we str or ldr */
-    if((iw >> 20) & 0b1 == 1)
+void branch_statistics_print(struct branch_unit *bpu)
+{
+    int i;
+    struct predictor *p;
+
+    printf("\nBranch Prediction Statistics:\n");
+    printf("-----------------------------------\n");
+    for(i = 0; i < bpu->npreds; i++)
     {
-        /* Shift to the byte/word bit & check if we are transferring a word or byte quantity */
-        if((iw >> 22) & 0b1 == 1)
+        p = &bpu->preds[i];
+        if(p->kind == BP_STATIC)
         {
-            val = *((unsigned char *) (state->regs[rn] + offset));
+            printf("%s: ", bp_kind_names[p->kind]);
         }
         else
         {
-            val = *((unsigned int *) (state->regs[rn] + offset));
-        }
-        
-        /* Store the value in the register */
-        state->regs[rd] = val;
-    }
-    /* Otherwise, load the value from a register */
-    else
-    {
-        val = state->regs[rd];
-        *(unsigned int *) (state->regs[rn] + offset) = val;
-    }
-
-    if(rd != PC)
-    {
-        state->regs[PC] = state->regs[PC] + 4;
+            printf("%s:%d: ", bp_kind_names[p->kind], p->bits);
+        }
+        printf("%llu mispredicts of %llu (%.1f%%)\n", p->mispredicts, p->predictions,
+               p->predictions == 0 ? 0 : (double) p->mispredicts / p->predictions * 100);
     }
+    printf("BTB hits: %llu, misses: %llu (%.1f%%)\n", bpu->btb_hits, bpu->btb_misses,
+           bpu->btb_hits + bpu->btb_misses == 0 ? 0 :
+           (double) bpu->btb_misses / (bpu->btb_hits + bpu->btb_misses) * 100);
+    printf("RAS hits: %llu, misses: %llu (%.1f%%)\n", bpu->ras_hits, bpu->ras_misses,
+           bpu->ras_hits + bpu->ras_misses == 0 ? 0 :
+           (double) bpu->ras_misses / (bpu->ras_hits + bpu->ras_misses) * 100);
+}
 
-    incrementMemoryCount(state);
+void timing_statistics_print(struct arm_state *state)
+{
+    struct timing *tm = state->tm;
+
+    printf("\nTiming Estimate (%s):\n", tm->model->name);
+    printf("-----------------------------------\n");
+    printf("Estimated cycles: %llu\n", tm->cycles);
+    printf("Estimated CPI: %.2f\n", (double) tm->cycles / state->total_inst_count);
+    printf("Base cycles: %llu (%.1f%%)\n", tm->base_cycles, (double) tm->base_cycles / tm->cycles * 100);
+    printf("Load-use stalls: %llu (%.1f%%)\n", tm->load_use_stalls, (double) tm->load_use_stalls / tm->cycles * 100);
+    printf("Branch-taken stalls: %llu (%.1f%%)\n", tm->branch_stalls, (double) tm->branch_stalls / tm->cycles * 100);
+    printf("Cache-miss stalls: %llu (%.1f%%)\n", tm->cache_stalls, (double) tm->cache_stalls / tm->cycles * 100);
 }
 
-void armemu_one(struct arm_state *state)
+/* Loops of the profiled function, hottest first */
+void loop_profile_print(struct loop_profile *prof)
 {
-    unsigned int iw;
-    
-    iw = *((unsigned int *) state->regs[PC]);
+    struct hot_loop *order[MAX_LOOPS], *tmp;
+    int i, j;
 
-    if(is_bx_inst(iw))
-    {
-        armemu_bx(state);
-    }
-    else if(is_mul_inst(iw))
+    for(i = 0; i < prof->nloops; i++)
     {
-        armemu_mul(state);
+        order[i] = &prof->loops[i];
+        for(j = i; j > 0 && order[j]->count > order[j - 1]->count; j--)
+        {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
     }
-    else if(is_mem_inst(iw))
+
+    printf("\nHot Loops (%s, %d blocks):\n", prof->function, prof->nblocks);
+    printf("-----------------------------------\n");
+    for(i = 0; i < prof->nloops; i++)
     {
-        armemu_mem(state);
+        printf("Header +%d (depth %d, %d blocks): %d header hits\n", order[i]->header - prof->base,
+               order[i]->depth, order[i]->nblocks, order[i]->count);
     }
-    else if(is_dp_inst(iw))
+}
+
+/* Hottest pages with a strip of their 64 lines, then the working set of
+ * each window. Counts are scaled back up by the sampling rate. */
+void heatmap_print(struct heatmap *heat, unsigned long long now)
+{
+    static const char ramp[] = " .:-=+*#%@";
+    struct heavy_hitter *order[HEAT_TOPK], *tmp;
+    unsigned long long counts[1 << (PAGE_SHIFT - LINE_SHIFT)], max;
+    unsigned int pages, lines, peak = 0;
+    char strip[(1 << (PAGE_SHIFT - LINE_SHIFT)) + 1];
+    int i, j, nlines = 1 << (PAGE_SHIFT - LINE_SHIFT);
+
+    printf("\nMemory Heat Map (1 in %d accesses, %llu samples):\n", heat->rate, heat->samples);
+    printf("-----------------------------------\n");
+
+    for(i = 0; i < heat->ntop; i++)
     {
-        armemu_dp(state);
+        order[i] = &heat->top[i];
+        for(j = i; j > 0 && order[j]->count > order[j - 1]->count; j--)
+        {
+            tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
     }
-    else if(is_b_inst(iw))
+
+    for(i = 0; i < heat->ntop; i++)
     {
-        if(is_condition(state))
+        max = 0;
+        for(j = 0; j < nlines; j++)
         {
-            armemu_b(state);
+            counts[j] = count_min_estimate(&heat->lines, (order[i]->page << (PAGE_SHIFT - LINE_SHIFT)) + j);
+            if(counts[j] > max)
+            {
+                max = counts[j];
+            }
         }
-        else
+        for(j = 0; j < nlines; j++)
         {
-            state->regs[PC] = state->regs[PC] + 4;
-            state->branch_not_taken = state->branch_not_taken + 1;
+            strip[j] = ramp[max == 0 ? 0 : (counts[j] * (sizeof(ramp) - 2) + max - 1) / max];
         }
-        incrementBranchCount(state);
+        strip[nlines] = '\0';
+        printf("Page 0x%08X: ~%llu |%s|\n", order[i]->page << PAGE_SHIFT, order[i]->count * heat->rate, strip);
     }
 
-    simulate_cache(state->dmc, iw);
-}
-
-unsigned int armemu(struct arm_state *state)
-{
-    /* Execute instructions until PC = 0 */
-    /* This happens when bx lr is issued and lr is 0 */
-    while(state->regs[PC] != 0)
+    printf("Working set per %llu instructions (pages/lines):", heat->window);
+    for(i = 0; i < heat->nwindows; i++)
     {
-        armemu_one(state);
+        pages = hll_estimate(&heat->timeline[i].pages);
+        lines = hll_estimate(&heat->timeline[i].lines);
+        printf(" %u/%u", pages, lines);
+        if(lines > peak)
+        {
+            peak = lines;
+        }
     }
 
-    return state->regs[0];
-} 
-
-
-/*-------- Printing functions for testing and/or debugging ---------*/
-
-void arm_state_print(struct arm_state *as)
-{
-    int i;
-
-    for(i = 0; i < NREGS; i++)
+    /* The window still open is estimated in place, so printing leaves
+     * the timeline as it was */
+    if(now > heat->window_end - heat->window)
     {
-        printf("reg[%d] = %d\n", i, as->regs[i]);
+        pages = hll_estimate(&heat->window_pages);
+        lines = hll_estimate(&heat->window_lines);
+        printf(" open %u/%u", pages, lines);
+        if(lines > peak)
+        {
+            peak = lines;
+        }
     }
-    printf("cpsr = %X\n", as->cpsr);
-}
-
-void cache_statistics_print(struct cache *dmc)
-{
-    printf("\nCache Statistics:\n");
-    printf("-----------------------------------\n");
-    printf("Hits: %d (%.1f%)\n", dmc->hits, (double) dmc->hits / dmc->requests * 100);
-    printf("Misses: %d (%.1f%)\n", dmc->misses, (double) dmc->misses / dmc->requests * 100);
-    printf("Requests: %d\n", dmc->requests);
+    printf("\nPeak working set: ~%u lines (%u bytes)\n", peak, peak << LINE_SHIFT);
 }
 
 void cache_state_print(struct cache *dmc)
@@ -791,113 +5207,718 @@ void print_fib_iter_tests(struct arm_state *state)
     printf("\n");
 }
 
-void print_fib_rec_tests(struct arm_state *state)
+void print_fib_rec_tests(struct arm_state *state)
+{
+    unsigned int r;
+
+    printf("\n----------------Begin Fib_Rec Tests------------------\n\n");    
+    
+    int i;
+
+    printf("Non-Emulated (fib_rec_a(20): ");
+    for(i = 0; i < 20; i++)
+    {
+        if(i == 19)
+        {
+            printf("%d)\n", fib_rec_a(i));
+        }
+        else
+        {
+            printf("%d, ", fib_rec_a(i));
+        }
+    }
+
+    printf("Emulated (fib_rec_a(20): ");
+    for(i = 0; i < 20; i++)
+    {
+        arm_state_init(state, (unsigned int *) fib_rec_a, i, 0, 0, 0);
+        if (i == 19)
+        {
+            printf("%d)\n", armemu(state));
+        }
+        else
+        {
+            printf("%d, ", armemu(state));
+        }
+    }
+    print_stats(state);
+    printf("\n");
+}
+
+void print_str_len_tests(struct arm_state *state)
+{
+    unsigned int r;
+
+    printf("\n----------------Begin Str_Len Tests------------------\n\n");        
+    char* word = "0123456789";
+    printf("Non-Emulated (strlen_a('%s')): %d\n", word, strlen_a(word));
+    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word, 0, 0, 0);
+    r = armemu(state);
+    printf("Emulated (strlen_a('%s')) = %d\n", word, r);
+    print_stats(state);
+
+    printf("\n");
+
+    char* word1 = "mouse";
+    printf("Non-Emulated (strlen_a('%s')): %d\n", word1, strlen_a(word1));
+    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word1, 0, 0, 0);
+    r = armemu(state);
+    printf("Emulated (strlen_a('%s')) = %d\n", word1, r);
+    print_stats(state);
+    
+    printf("\n");
+
+    char* word2 = "";
+    printf("Non-Emulated (strlen_a('%s')): %d\n", word2, strlen_a(word2));
+    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word2, 0, 0, 0);
+    r = armemu(state);
+    printf("Emulated (strlen_a('%s')) = %d\n", word2, r);
+    print_stats(state);
+
+    printf("\n");
+
+    char* word3 = "madeline";
+    printf("Non-Emulated (strlen_a('%s')): %d\n", word3, strlen_a(word3));
+    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word3, 0, 0, 0);
+    r = armemu(state);
+    printf("Emulated (strlen_a('%s')) = %d\n", word3, r);
+    print_stats(state);
+
+    printf("\n");
+}
+
+void print_simd_tests(struct arm_state *state)
+{
+    unsigned int r;
+    int i;
+
+    printf("\n----------------Begin SIMD Tests------------------\n\n");
+
+    int sum_array[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    printf("Non-Emulated (sum_array_v_a([1, 2, 3, 4, 5, 6, 7, 8], 8)): %d\n", sum_array_v_a(sum_array, 8));
+    arm_state_init(state, (unsigned int *) sum_array_v_a, (unsigned int) sum_array, 8, 0, 0);
+    r = armemu(state);
+    printf("Emulated (sum_array_v_a([1, 2, 3, 4, 5, 6, 7, 8], 8)): %d\n", r);
+    print_stats(state);
+
+    printf("\n");
+
+    int sum_array1[1000] = {[0 ... 999] = 1};
+    printf("Non-Emulated (sum_array_v_a([1, 1, 1, 1, ...], 1000)): %d\n", sum_array_v_a(sum_array1, 1000));
+    arm_state_init(state, (unsigned int *) sum_array_v_a, (unsigned int) sum_array1, 1000, 0, 0);
+    r = armemu(state);
+    printf("Emulated (sum_array_v_a([1, 1, 1, 1, ...], 1000)): %d\n", r);
+    print_stats(state);
+
+    printf("\n");
+
+    int find_max_array[8] = {1, -2, 3, 40, 5, -6, 7, 8};
+    printf("Non-Emulated (find_max_v_a([1, -2, 3, 40, 5, -6, 7, 8], 8)): %d\n", find_max_v_a(find_max_array, 8));
+    arm_state_init(state, (unsigned int *) find_max_v_a, (unsigned int) find_max_array, 8, 0, 0);
+    r = armemu(state);
+    printf("Emulated (find_max_v_a([1, -2, 3, 40, 5, -6, 7, 8], 8)): %d\n", r);
+    print_stats(state);
+
+    printf("\n");
+
+    int find_max_array1[1000];
+    for(i = 0; i < 1000; i++)
+    {
+        find_max_array1[i] = (i * 37) % 1000 - 500;
+    }
+    printf("Non-Emulated (find_max_v_a([-500, -463, -426, ...], 1000)): %d\n", find_max_v_a(find_max_array1, 1000));
+    arm_state_init(state, (unsigned int *) find_max_v_a, (unsigned int) find_max_array1, 1000, 0, 0);
+    r = armemu(state);
+    printf("Emulated (find_max_v_a([-500, -463, -426, ...], 1000)): %d\n", r);
+    print_stats(state);
+
+    printf("\n");
+
+    float args[4] = {2.0, 1.5, -3.0, 0.25};
+    float result;
+    quadratic_f_a(&result, args);
+    printf("Non-Emulated (quadratic_f_a(2.0, 1.5, -3.0, 0.25)): %f\n", result);
+    result = 0;
+    arm_state_init(state, (unsigned int *) quadratic_f_a, (unsigned int) &result, (unsigned int) args, 0, 0);
+    armemu(state);
+    printf("Emulated (quadratic_f_a(2.0, 1.5, -3.0, 0.25)): %f\n", result);
+    print_stats(state);
+
+    printf("\n");
+
+    /* vpadd.f32 d0, d1, d2; bx lr. Shares VMUL.F32's opcode bits but is not implemented */
+    unsigned int vpadd_code[2] = {0xF3010D02, 0xE12FFF1E};
+    arm_state_init(state, vpadd_code, 0, 0, 0, 0);
+    armemu(state);
+    printf("Emulated (vpadd.f32 d0, d1, d2): %s\n",
+           state->fault == FAULT_UNDEFINED ? "undefined instruction" : "no fault");
+
+    printf("\n");
+}
+
+/* Run an array kernel over every window of a mapped input, adding the
+ * per-window results up or taking their maximum. n is rounded down to a
+ * multiple of the kernel's vector width in each window. */
+void print_mapped_kernel(struct arm_state *state, struct mapped_input *in, char *name,
+                         int (*kernel)(int *array, int n), bool is_max, int width)
+{
+    off_t offset;
+    long long total = 0;
+    int n, native = 0, emulated = 0, r;
+    bool first = true;
+
+    for(offset = 0; offset < in->size; offset += INPUT_WINDOW)
+    {
+        if(map_window(in, offset) != 0)
+        {
+            perror("Could not map input window");
+            exit(1);
+        }
+
+        n = (in->len / sizeof(int)) & ~(width - 1);
+        if(n == 0)
+        {
+            continue;
+        }
+
+        r = kernel((int *) in->addr, n);
+        native = first ? r : is_max ? (r > native ? r : native) : native + r;
+
+        arm_state_init(state, (unsigned int *) kernel, (unsigned int) in->addr, n, 0, 0);
+        r = armemu(state);
+        emulated = first ? r : is_max ? (r > emulated ? r : emulated) : emulated + r;
+
+        first = false;
+        total += n;
+    }
+
+    printf("Non-Emulated (%s(%s, %lld)): %d\n", name, in->path, total, native);
+    printf("Emulated (%s(%s, %lld)): %d\n", name, in->path, total, emulated);
+
+    /* Statistics cover the last window */
+    print_stats(state);
+
+    printf("\n");
+}
+
+/* Run the array kernels over a mapped input file of ints */
+void print_mapped_tests(struct arm_state *state, struct mapped_input *in)
+{
+    printf("\n----------------Begin Mapped Input Tests------------------\n\n");
+    printf("Mapped %s: %lld bytes in windows of up to %d bytes (%s)\n\n", in->path,
+           (long long) in->size, INPUT_WINDOW, in->readonly ? "read-only" : "copy-on-write");
+
+    /* The scalar kernels store each element back, which a read-only mapping does not allow */
+    if(!in->readonly)
+    {
+        print_mapped_kernel(state, in, "sum_array_a", sum_array_a, false, 1);
+        print_mapped_kernel(state, in, "find_max_a", find_max_a, true, 1);
+    }
+
+    /* The vector kernels work on multiples of 4 elements */
+    print_mapped_kernel(state, in, "sum_array_v_a", sum_array_v_a, false, 4);
+    print_mapped_kernel(state, in, "find_max_v_a", find_max_v_a, true, 4);
+}
+
+void print_device_tests(struct arm_state *state, unsigned int base)
+{
+    struct bus bus;
+    unsigned long long fired;
+    unsigned int r;
+
+    printf("\n----------------Begin Device Tests------------------\n\n");
+
+    bus_init(&bus, base);
+
+    /* The device window is not host memory, so these only run emulated */
+    printf("Emulated (uart_puts_a('hello from the uart\\n', 0x%X)):\n", base);
+    arm_state_init(state, (unsigned int *) uart_puts_a, (unsigned int) "hello from the uart\n", base, 0, 0);
+    bus_attach(state, &bus);
+    r = armemu(state);
+    uart_flush(&bus.uart);
+    printf("Characters written: %d\n", r);
+    print_stats(state);
+
+    printf("\n");
+
+    arm_state_init(state, (unsigned int *) timer_wait_a, base, 1000, 0, 0);
+    bus_attach(state, &bus);
+    r = armemu(state);
+    printf("Emulated (timer_wait_a(0x%X, 1000)): %d polls\n", base, r);
+    printf("Events fired: %llu, device reads: %llu, device writes: %llu\n", bus.sched.fired, bus.reads, bus.writes);
+    print_stats(state);
+
+    /* Reloading a running periodic timer with 0 stops it at its next expiry */
+    fired = bus.sched.fired;
+    timer_write(state, 0x0, 100);
+    timer_write(state, 0x8, 0b11);
+    state->total_inst_count += 100;
+    sched_run(state);
+    timer_write(state, 0x0, 0);
+    state->total_inst_count += 100;
+    sched_run(state);
+    printf("Periodic timer reloaded with 0: %s after %llu events\n",
+           (bus.timer.ctrl & 0b1) ? "running" : "stopped", bus.sched.fired - fired);
+
+    /* Detach so later tests see plain RAM */
+    state->bus = NULL;
+    state->bus_size = 0;
+
+    printf("\n");
+}
+
+/* Same sources as sum_array_a.s, sum_array_v_a.s and quadratic_f_a.s,
+ * assembled in-process at runtime */
+char *sum_array_src =
+    "\t.global sum_array_a\n"
+    "\t.func sum_array_a\n"
+    "\n"
+    "/* r0 - int* array */\n"
+    "/* r1 - int n */\n"
+    "/* r2 - int i */\n"
+    "/* r3 - int total */\n"
+    "sum_array_a:\n"
+    "\tmov r2, #0\n"
+    "\tmov r3, #0\n"
+    "loop:\n"
+    "\t//loop check\n"
+    "\tcmp r2, r1\n"
+    "\tbeq endloop\n"
+    "\n"
+    "\t//loop body\n"
+    "\tldr r12, [r0]\n"
+    "\tadd r3, r12, r3\n"
+    "\tstr r12, [r0]\n"
+    "\n"
+    "\t//increment variables\n"
+    "\tadd r2, r2, #1\n"
+    "\tadd r0, r0, #4\n"
+    "\tb loop\n"
+    "endloop:\n"
+    "\tmov r0, r3\n"
+    "\tbx lr\n";
+
+char *sum_array_v_src =
+    "\t.global sum_array_v_a\n"
+    "\t.func sum_array_v_a\n"
+    "\n"
+    "/* r0 - int* array */\n"
+    "/* r1 - int n (multiple of 4) */\n"
+    "/* r2 - int i */\n"
+    "/* q1 - int total[4] */\n"
+    "sum_array_v_a:\n"
+    "\tmov r2, #0\n"
+    "\tvdup.32 q1, r2\n"
+    "loop:\n"
+    "\t//loop check\n"
+    "\tcmp r2, r1\n"
+    "\tbeq endloop\n"
+    "\n"
+    "\t//add the next four elements to the partial sums\n"
+    "\tvld1.32 {d0, d1}, [r0]!\n"
+    "\tvadd.i32 q1, q1, q0\n"
+    "\n"
+    "\t//increment variables\n"
+    "\tadd r2, r2, #4\n"
+    "\tb loop\n"
+    "endloop:\n"
+    "\t//add up the four partial sums\n"
+    "\tsub sp, sp, #16\n"
+    "\tvst1.32 {d2, d3}, [sp]\n"
+    "\tldr r0, [sp]\n"
+    "\tldr r1, [sp, #4]\n"
+    "\tadd r0, r0, r1\n"
+    "\tldr r1, [sp, #8]\n"
+    "\tadd r0, r0, r1\n"
+    "\tldr r1, [sp, #12]\n"
+    "\tadd r0, r0, r1\n"
+    "\tadd sp, sp, #16\n"
+    "\tbx lr\n";
+
+char *quadratic_f_src =
+    "\t.global quadratic_f_a\n"
+    "\t.func quadratic_f_a\n"
+    "\n"
+    "/* r0 - float *result */\n"
+    "/* r1 - float args[4] (x, a, b, c) */\n"
+    "quadratic_f_a:\n"
+    "\tvldr s0, [r1]\n"
+    "\tvldr s1, [r1, #4]\n"
+    "\tvldr s2, [r1, #8]\n"
+    "\tvldr s3, [r1, #12]\n"
+    "\n"
+    "\t//a * x * x + b * x + c\n"
+    "\tvmul.f32 s4, s0, s0\n"
+    "\tvmul.f32 s4, s4, s1\n"
+    "\tvmla.f32 s4, s0, s2\n"
+    "\tvadd.f32 s4, s4, s3\n"
+    "\n"
+    "\tvstr s4, [r0]\n"
+    "\tbx lr\n";
+
+/* Loads below the base register, which encode U clear */
+char *load_below_src =
+    "\t.global load_below_a\n"
+    "\n"
+    "/* r0 - int *p, returns p[-1] + the low byte of p[-2] */\n"
+    "load_below_a:\n"
+    "\tldr r1, [r0, #-4]\n"
+    "\tldrb r2, [r0, #-8]\n"
+    "\tadd r0, r1, r2\n"
+    "\tbx lr\n";
+
+/* Compare the words assembled for name, up to its bx lr, with the
+ * natively built function */
+void print_asm_compare(struct assembler *as, char *name, unsigned int *native)
+{
+    unsigned int *code = (unsigned int *) asm_global(as, name);
+    int i;
+
+    for(i = 0; code[i] == native[i]; i++)
+    {
+        if(code[i] == 0xE12FFF1E)
+        {
+            printf("Encoding of %s matches the native build: yes (%d words)\n", name, i + 1);
+            return;
+        }
+    }
+
+    printf("Encoding of %s matches the native build: no, word %d is 0x%08X, expected 0x%08X\n",
+           name, i, code[i], native[i]);
+}
+
+void print_assembler_tests(struct arm_state *state)
+{
+    struct assembler as;
+    unsigned int r, entry;
+
+    printf("\n----------------Begin Assembler Tests------------------\n\n");
+
+    asm_init(&as);
+    asm_add_source(&as, "sum_array_src", sum_array_src);
+    asm_add_source(&as, "sum_array_v_src", sum_array_v_src);
+    asm_add_source(&as, "quadratic_f_src", quadratic_f_src);
+    asm_add_source(&as, "load_below_src", load_below_src);
+    if(asm_assemble(&as) != 0)
+    {
+        printf("Assembly failed\n");
+        return;
+    }
+
+    print_asm_compare(&as, "sum_array_a", (unsigned int *) sum_array_a);
+    print_asm_compare(&as, "sum_array_v_a", (unsigned int *) sum_array_v_a);
+    print_asm_compare(&as, "quadratic_f_a", (unsigned int *) quadratic_f_a);
+
+    entry = asm_global(&as, "sum_array_a");
+    int sum_array[5] = {10, 12, 14, 16, 18};
+    printf("Non-Emulated (sum_array_a([10, 12, 14, 16, 18], 5)): %d\n", sum_array_a(sum_array, 5));
+    arm_state_init(state, (unsigned int *) entry, (unsigned int) sum_array, 5, 0, 0);
+    r = armemu(state);
+    printf("Emulated, assembled in-process (sum_array_a([10, 12, 14, 16, 18], 5)): %d\n", r);
+    print_stats(state);
+
+    entry = asm_global(&as, "sum_array_v_a");
+    int sum_array_v[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    printf("Non-Emulated (sum_array_v_a([1, 2, 3, 4, 5, 6, 7, 8], 8)): %d\n", sum_array_v_a(sum_array_v, 8));
+    arm_state_init(state, (unsigned int *) entry, (unsigned int) sum_array_v, 8, 0, 0);
+    r = armemu(state);
+    printf("Emulated, assembled in-process (sum_array_v_a([1, 2, 3, 4, 5, 6, 7, 8], 8)): %d\n", r);
+    print_stats(state);
+
+    entry = asm_global(&as, "load_below_a");
+    int below[3] = {5, 30, 7};
+    arm_state_init(state, (unsigned int *) entry, (unsigned int) &below[2], 0, 0, 0);
+    r = armemu(state);
+    printf("Emulated, assembled in-process (load_below_a([5, 30, 7] + 2)): %d (expected 35)\n", r);
+
+    printf("\n");
+}
+
+/* Assemble the .s files given with -s and run the entry point */
+void run_asm_files(struct arm_state *state, struct asm_run *run)
 {
-    unsigned int r;
-
-    printf("\n----------------Begin Fib_Rec Tests------------------\n\n");    
-    
+    struct assembler as;
+    unsigned int r, entry;
     int i;
 
-    printf("Non-Emulated (fib_rec_a(20): ");
-    for(i = 0; i < 20; i++)
+    asm_init(&as);
+    for(i = 0; i < run->nfiles; i++)
     {
-        if(i == 19)
-        {
-            printf("%d)\n", fib_rec_a(i));
-        }
-        else
+        if(asm_add_file(&as, run->files[i]) != 0)
         {
-            printf("%d, ", fib_rec_a(i));
+            perror(run->files[i]);
+            exit(1);
         }
     }
+    if(asm_assemble(&as) != 0)
+    {
+        exit(1);
+    }
 
-    printf("Emulated (fib_rec_a(20): ");
-    for(i = 0; i < 20; i++)
+    /* Default to the first global */
+    entry = asm_global(&as, run->entry);
+    if(entry == 0)
     {
-        arm_state_init(state, (unsigned int *) fib_rec_a, i, 0, 0, 0);
-        if (i == 19)
-        {
-            printf("%d)\n", armemu(state));
-        }
-        else
+        fprintf(stderr, "No global entry point %s\n", run->entry ? run->entry : "");
+        exit(1);
+    }
+
+    /* Untrusted code may only run its own code and use its stack */
+    if(run->mmu)
+    {
+        state->mmu = (struct mmu *)malloc(sizeof(struct mmu));
+        mmu_init(state->mmu);
+        if(mmu_map(state->mmu, (unsigned int) as.code, as.ncode * 4, PTE_R | PTE_X) != 0
+           || mmu_map(state->mmu, (unsigned int) state->stack, state->stack_size, PTE_R | PTE_W) != 0)
         {
-            printf("%d, ", armemu(state));
+            perror("Could not build the page tables");
+            exit(1);
         }
     }
+
+    arm_state_init(state, (unsigned int *) entry, run->args[0], run->args[1], run->args[2], run->args[3]);
+    r = armemu(state);
+    printf("Emulated (%s(%d, %d, %d, %d)): %d\n", run->entry ? run->entry : run->files[0],
+           run->args[0], run->args[1], run->args[2], run->args[3], r);
     print_stats(state);
-    printf("\n");
 }
 
-void print_str_len_tests(struct arm_state *state)
+void print_stack_tests(struct arm_state *state)
 {
+    struct arm_state small;
     unsigned int r;
 
-    printf("\n----------------Begin Str_Len Tests------------------\n\n");        
-    char* word = "0123456789";
-    printf("Non-Emulated (strlen_a('%s')): %d\n", word, strlen_a(word));
-    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word, 0, 0, 0);
+    printf("\n----------------Begin Stack Tests------------------\n\n");
+
+    /* fib_rec_a recurses into n - 2 first, using 16 bytes per frame */
+    printf("Emulated with a %zu byte stack (fib_rec_a(25)): ", state->stack_size);
+    arm_state_init(state, (unsigned int *) fib_rec_a, 25, 0, 0, 0);
     r = armemu(state);
-    printf("Emulated (strlen_a('%s')) = %d\n", word, r);
+    printf("%d\n", r);
     print_stats(state);
 
     printf("\n");
 
-    char* word1 = "mouse";
-    printf("Non-Emulated (strlen_a('%s')): %d\n", word1, strlen_a(word1));
-    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word1, 0, 0, 0);
-    r = armemu(state);
-    printf("Emulated (strlen_a('%s')) = %d\n", word1, r);
-    print_stats(state);
-    
+    /* One page holds 256 frames, so this overflows on the first descent */
+    small = *state;
+    if(arm_stack_alloc(&small, sysconf(_SC_PAGESIZE)) != 0)
+    {
+        perror("Could not allocate a guest stack");
+        return;
+    }
+    arm_state_init(&small, (unsigned int *) fib_rec_a, 1000, 0, 0, 0);
+    armemu(&small);
+    printf("Emulated with a %zu byte stack (fib_rec_a(1000)): %s\n", small.stack_size,
+           small.fault == FAULT_STACK_OVERFLOW ? "stack overflow" : "no fault");
+    arm_stack_free(&small);
+
     printf("\n");
+}
 
-    char* word2 = "";
-    printf("Non-Emulated (strlen_a('%s')): %d\n", word2, strlen_a(word2));
-    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word2, 0, 0, 0);
+void print_mmu_tests(struct arm_state *state)
+{
+    struct mmu mmu;
+    int sum_array[5] = {1, 2, 3, 4, 5};
+    unsigned char *pages;
+    size_t page;
+    unsigned int r;
+
+    printf("\n----------------Begin MMU Tests------------------\n\n");
+
+    mmu_init(&mmu);
+    mmu_map(&mmu, (unsigned int) __executable_start, etext - __executable_start, PTE_R | PTE_X);
+    mmu_map(&mmu, (unsigned int) state->stack, state->stack_size, PTE_R | PTE_W);
+    mmu_map(&mmu, (unsigned int) sum_array, sizeof(sum_array), PTE_R | PTE_W);
+    state->mmu = &mmu;
+    arm_state_init(state, (unsigned int *) sum_array_a, (unsigned int) sum_array, 5, 0, 0);
     r = armemu(state);
-    printf("Emulated (strlen_a('%s')) = %d\n", word2, r);
+    printf("Emulated with the MMU (sum_array_a([1, 2, 3, 4, 5], 5)): %d\n", r);
     print_stats(state);
 
     printf("\n");
 
-    char* word3 = "madeline";
-    printf("Non-Emulated (strlen_a('%s')): %d\n", word3, strlen_a(word3));
-    arm_state_init(state, (unsigned int *) strlen_a, (unsigned int) word3, 0, 0, 0);
+    /* sum_array_a stores each element back, which a read-only page does not allow */
+    mmu_free(&mmu);
+    mmu_map(&mmu, (unsigned int) __executable_start, etext - __executable_start, PTE_R | PTE_X);
+    mmu_map(&mmu, (unsigned int) state->stack, state->stack_size, PTE_R | PTE_W);
+    mmu_map(&mmu, (unsigned int) sum_array, sizeof(sum_array), PTE_R);
+    arm_state_init(state, (unsigned int *) sum_array_a, (unsigned int) sum_array, 5, 0, 0);
+    armemu(state);
+    printf("Emulated with a read-only array (sum_array_a([1, 2, 3, 4, 5], 5)): %s\n",
+           state->fault == FAULT_DATA_ABORT ? "data abort" : "no fault");
+
+    /* Code without execute permission aborts on the first fetch */
+    mmu_free(&mmu);
+    mmu_map(&mmu, (unsigned int) __executable_start, etext - __executable_start, PTE_R);
+    mmu_map(&mmu, (unsigned int) state->stack, state->stack_size, PTE_R | PTE_W);
+    mmu_map(&mmu, (unsigned int) sum_array, sizeof(sum_array), PTE_R | PTE_W);
+    arm_state_init(state, (unsigned int *) sum_array_a, (unsigned int) sum_array, 5, 0, 0);
+    armemu(state);
+    printf("Emulated from non-executable code (sum_array_a([1, 2, 3, 4, 5], 5)): %s\n",
+           state->fault == FAULT_PREFETCH_ABORT ? "prefetch abort" : "no fault");
+
+    /* A word that starts on the last mapped page but ends on the next one aborts */
+    page = sysconf(_SC_PAGESIZE);
+    pages = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pages != MAP_FAILED)
+    {
+        mmu_free(&mmu);
+        mmu_map(&mmu, (unsigned int) __executable_start, etext - __executable_start, PTE_R | PTE_X);
+        mmu_map(&mmu, (unsigned int) state->stack, state->stack_size, PTE_R | PTE_W);
+        mmu_map(&mmu, (unsigned int) pages, page, PTE_R | PTE_W);
+        arm_state_init(state, (unsigned int *) sum_array_a, (unsigned int) (pages + page - 2), 1, 0, 0);
+        armemu(state);
+        printf("Emulated with a word across the mapped end (sum_array_a(end - 2, 1)): %s\n",
+               state->fault == FAULT_DATA_ABORT ? "data abort" : "no fault");
+        munmap(pages, 2 * page);
+    }
+
+    mmu_free(&mmu);
+    state->mmu = NULL;
+
+    printf("\n");
+}
+
+void print_semihosting_tests(struct arm_state *state)
+{
+    unsigned long long calls = state->sh->calls;
+    unsigned long long writes = state->sh->writes;
+    unsigned long long syscalls = state->sh->syscalls;
+    unsigned int r;
+
+    printf("\n----------------Begin Semihosting Tests------------------\n\n");
+
+    /* Guest output only, semihosting traps do not run natively */
+    printf("Emulated (semihost_puts_a(1, 'semihosted line\\n', 16, 8)):\n");
+    arm_state_init(state, (unsigned int *) semihost_puts_a, STDOUT_FILENO, (unsigned int) "semihosted line\n", 16, 8);
     r = armemu(state);
-    printf("Emulated (strlen_a('%s')) = %d\n", word3, r);
+    printf("Guest clock: %d centiseconds\n", r);
+    printf("Semihosting calls: %llu, writes: %llu, host syscalls: %llu\n", state->sh->calls - calls,
+           state->sh->writes - writes, state->sh->syscalls - syscalls);
     print_stats(state);
 
     printf("\n");
 }
 
+void print_smp_tests(struct arm_state *state, int ncores)
+{
+    struct arm_state *cores;
+    struct arm_state total;
+    int counter, i;
+    int n = 10000;
+
+    printf("\n----------------Begin SMP Tests------------------\n\n");
+
+    counter = 0;
+    for(i = 0; i < ncores; i++)
+    {
+        atomic_add_a(&counter, n);
+    }
+    printf("Non-Emulated (%d x atomic_add_a(&counter, %d)): %d\n", ncores, n, counter);
+
+    cores = (struct arm_state *)malloc(sizeof(struct arm_state) * ncores);
+    counter = 0;
+    for(i = 0; i < ncores; i++)
+    {
+        arm_core_init(&cores[i], state);
+        arm_state_init(&cores[i], (unsigned int *) atomic_add_a, (unsigned int) &counter, n, 0, 0);
+    }
+
+    armemu_smp(cores, ncores);
+    printf("Emulated on %d cores (atomic_add_a(&counter, %d)): %d\n", ncores, n, counter);
+
+    /* Report the merged counters of all cores, summed into fresh state
+     * so the totals of earlier tests are not included */
+    arm_core_init(&total, state);
+    arm_state_init(&total, NULL, 0, 0, 0, 0);
+    for(i = 0; i < ncores; i++)
+    {
+        arm_state_merge(&total, &cores[i]);
+    }
+    print_stats(&total);
+
+    arm_core_free(&total);
+    for(i = 0; i < ncores; i++)
+    {
+        arm_core_free(&cores[i]);
+    }
+    free(cores);
+
+    printf("\n");
+}
+
 
 /* Function to print out dynamic analysis of emulation */
 void print_stats(struct arm_state *state)
 {
     printf("\nProgram Statistics:\n");
     printf("-----------------------------------\n");
-    printf("Total number of dp instructions: %d (%.1f%)\n", state->dp_inst_count, (double) state->dp_inst_count / state->total_inst_count * 100);
-    printf("Total number of memory instructions: %d (%.1f%)\n", state->mem_inst_count, (double) state->mem_inst_count/state->total_inst_count * 100);
-    printf("total number of branch instructions: %d (%.1f%)\n", state->branch_inst_count, (double) state->branch_inst_count/state->total_inst_count * 100);
-    printf("Total number of instructions: %d\n", state->total_inst_count);
-    printf("Total number of branches taken: %d\n", state->branch_taken);
-    printf("Total number of branches not taken: %d\n", state->branch_not_taken);
+    printf("Total number of dp instructions: %llu (%.1f%%)\n", state->dp_inst_count, (double) state->dp_inst_count / state->total_inst_count * 100);
+    printf("Total number of memory instructions: %llu (%.1f%%)\n", state->mem_inst_count, (double) state->mem_inst_count/state->total_inst_count * 100);
+    printf("total number of branch instructions: %llu (%.1f%%)\n", state->branch_inst_count, (double) state->branch_inst_count/state->total_inst_count * 100);
+    printf("Total number of instructions: %llu\n", state->total_inst_count);
+    printf("Total number of branches taken: %llu\n", state->branch_taken);
+    printf("Total number of branches not taken: %llu\n", state->branch_not_taken);
 
     /* Add cache information here */
 
     cache_statistics_print(state->dmc);
+    if(state->dmc->pf->kind != PF_NONE)
+    {
+        prefetch_statistics_print(state->dmc);
+    }
+    branch_statistics_print(state->bpu);
+    timing_statistics_print(state);
+    if(state->prof != NULL && state->prof->active)
+    {
+        loop_profile_print(state->prof);
+    }
+    if(state->heat != NULL)
+    {
+        heatmap_print(state->heat, state->total_inst_count);
+    }
+    if(state->mmu != NULL)
+    {
+        printf("\nMMU Statistics:\n");
+        printf("-----------------------------------\n");
+        printf("TLB misses: %llu\n", state->mmu->tlb_misses);
+    }
 }
 
-void parse_command_line(int argc, char **argv, struct cache *dmc)
+void parse_command_line(int argc, char **argv, struct cache *dmc, struct timing *tm,
+                        struct branch_unit *bpu, int *ncores, struct mapped_input *in,
+                        unsigned int *dev_base, struct asm_run *run, size_t *stack_size,
+                        char **profile, int *heat_rate, int *heat_window,
+                        char **stats_name, unsigned long long *stats_interval)
 {
-    int i;
-
-    if(argc < 2)
+    int i, j;
+    char *suffix, *arg;
+    unsigned long base;
+
+    *stack_size = STACK_SIZE;
+    *profile = NULL;
+    *heat_rate = 0;
+    *heat_window = 0;
+    *stats_name = NULL;
+    *stats_interval = 1000000;
+    run->nfiles = 0;
+    run->entry = NULL;
+    run->mmu = false;
+    for(j = 0; j < 4; j++)
     {
-        dmc->size = 8;
+        run->args[j] = 0;
     }
-    else
+
+    *dev_base = DEV_BASE;
+    *ncores = 2;
+    in->path = NULL;
+    in->readonly = false;
+    dmc->size = 8;
+    dmc->pf->kind = PF_NONE;
+    tm->model = &timing_models[0];
+    bpu->npreds = 0;
+
+    if(argc >= 2)
     {
         for(i = 0; i < argc; i++)
         {
@@ -916,6 +5937,224 @@ void parse_command_line(int argc, char **argv, struct cache *dmc)
                 }
                 dmc->size = atoi(argv[i+1]);
             }
+            else if(strcmp(argv[i], "-t") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a name for the timing model\n");
+                    exit(1);
+                }
+                tm->model = find_timing_model(argv[i+1]);
+                if(tm->model == NULL)
+                {
+                    perror("Timing model must be one of arm11, cortex-a7, cortex-a9 or ideal.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-p") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a branch predictor\n");
+                    exit(1);
+                }
+                if(parse_predictor(bpu, argv[i+1]) != 0)
+                {
+                    perror("Branch predictor must be static, bimodal, gshare or tournament, with an optional :bits of 1 to 20.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-f") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a prefetcher\n");
+                    exit(1);
+                }
+                if(strcmp(argv[i+1], "nextline") == 0)
+                {
+                    dmc->pf->kind = PF_NEXT_LINE;
+                }
+                else if(strcmp(argv[i+1], "stride") == 0)
+                {
+                    dmc->pf->kind = PF_STRIDE;
+                }
+                else if(strcmp(argv[i+1], "stream") == 0)
+                {
+                    dmc->pf->kind = PF_STREAM;
+                }
+                else
+                {
+                    perror("Prefetcher must be nextline, stride or stream.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-n") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide the number of cores\n");
+                    exit(1);
+                }
+                *ncores = atoi(argv[i+1]);
+                if(*ncores < 1 || *ncores > MAX_CORES)
+                {
+                    perror("Number of cores must be between 1 and 64.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-m") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide an input file to map\n");
+                    exit(1);
+                }
+                in->path = argv[i+1];
+                suffix = strrchr(in->path, ':');
+                if(suffix != NULL && strcmp(suffix, ":ro") == 0)
+                {
+                    *suffix = '\0';
+                    in->readonly = true;
+                }
+            }
+            else if(strcmp(argv[i], "-D") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a base address for the devices\n");
+                    exit(1);
+                }
+                errno = 0;
+                base = strtoul(argv[i+1], &arg, 16);
+                if(errno != 0 || arg == argv[i+1] || *arg != '\0')
+                {
+                    perror("Device base address must be a hexadecimal number.\n");
+                    exit(1);
+                }
+                /* The device window must fit below 4 GB and cannot start at 0 */
+                if(base == 0 || base > 0xFFFFFFFFUL - (DEV_SIZE - 1) || (base & (DEV_SIZE - 1)) != 0)
+                {
+                    perror("Device base address must be a non-zero multiple of 0x1000 below 4 GB.\n");
+                    exit(1);
+                }
+                *dev_base = base;
+            }
+            else if(strcmp(argv[i], "-k") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide the guest stack size\n");
+                    exit(1);
+                }
+                *stack_size = strtoul(argv[i+1], NULL, 0);
+                if(*stack_size < 1024)
+                {
+                    perror("Guest stack size must be at least 1024 bytes.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-s") == 0)
+            {
+                if(argv[i+1] == NULL || run->nfiles == MAX_ASM_FILES)
+                {
+                    perror("Provide up to 16 assembly files\n");
+                    exit(1);
+                }
+                run->files[run->nfiles++] = argv[i+1];
+            }
+            else if(strcmp(argv[i], "-e") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide an entry point\n");
+                    exit(1);
+                }
+                run->entry = argv[i+1];
+            }
+            else if(strcmp(argv[i], "-b") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a profile from analyze -o\n");
+                    exit(1);
+                }
+                *profile = argv[i+1];
+            }
+            else if(strcmp(argv[i], "-S") == 0)
+            {
+                if(argv[i+1] == NULL || argv[i+1][0] != '/')
+                {
+                    perror("Provide a shared memory name starting with /\n");
+                    exit(1);
+                }
+                *stats_name = argv[i+1];
+                suffix = strrchr(*stats_name, ':');
+                if(suffix != NULL)
+                {
+                    *suffix = '\0';
+                    *stats_interval = strtoull(suffix + 1, NULL, 0);
+                }
+                if(*stats_interval < 1)
+                {
+                    perror("Publishing interval must be at least 1 instruction.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-M") == 0)
+            {
+                run->mmu = true;
+            }
+            else if(strcmp(argv[i], "-H") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide a sampling rate\n");
+                    exit(1);
+                }
+                *heat_rate = strtol(argv[i+1], &arg, 0);
+                *heat_window = 10000;
+                if(*arg == ':')
+                {
+                    *heat_window = strtol(arg + 1, NULL, 0);
+                }
+                if(*heat_rate < 1 || *heat_window < 1)
+                {
+                    perror("Sampling rate and window must be at least 1.\n");
+                    exit(1);
+                }
+            }
+            else if(strcmp(argv[i], "-r") == 0)
+            {
+                if(argv[i+1] == NULL)
+                {
+                    perror("Provide the arguments\n");
+                    exit(1);
+                }
+                /* Up to four comma separated numbers */
+                arg = argv[i+1];
+                for(j = 0; j < 4; j++)
+                {
+                    suffix = arg;
+                    errno = 0;
+                    run->args[j] = strtol(suffix, &arg, 0);
+                    if(errno != 0 || arg == suffix || (*arg != ',' && *arg != '\0'))
+                    {
+                        perror("Arguments must be up to four comma separated numbers.\n");
+                        exit(1);
+                    }
+                    if(*arg == '\0')
+                    {
+                        break;
+                    }
+                    arg++;
+                }
+                if(j == 4)
+                {
+                    perror("Arguments must be up to four comma separated numbers.\n");
+                    exit(1);
+                }
+            }
         }
     }
 }
@@ -924,19 +6163,108 @@ int main(int argc, char **argv)
 {
     struct arm_state state;
     struct cache dmc;
+    struct timing tm;
+    struct branch_unit bpu;
+    struct prefetcher pf;
     unsigned int r;
-
-    parse_command_line(argc, argv, &dmc);
+    struct mapped_input in;
+    unsigned int dev_base;
+    struct asm_run run;
+    struct semihost sh;
+    struct loop_profile prof;
+    struct heatmap *heat;
+    struct stats_export stats;
+    char *profile, *stats_name;
+    unsigned long long stats_interval;
+    size_t stack_size;
+    int ncores, heat_rate, heat_window;
+
+    dmc.pf = &pf;
+    parse_command_line(argc, argv, &dmc, &tm, &bpu, &ncores, &in, &dev_base, &run, &stack_size, &profile,
+                       &heat_rate, &heat_window, &stats_name, &stats_interval);
+
+    if(arm_stack_alloc(&state, stack_size) != 0)
+    {
+        perror("Could not allocate the guest stack");
+        exit(1);
+    }
+    fault_handler_install();
 
     struct_init(&dmc);
+    prefetcher_init(&pf);
+    branch_unit_init(&bpu);
     state.dmc = &dmc;
+    state.tm = &tm;
+    state.bpu = &bpu;
+    state.bus = NULL;
+    state.bus_base = 0;
+    state.bus_size = 0;
+
+    semihost_init(&sh);
+    state.sh = &sh;
+
+    state.prof = NULL;
+    if(profile != NULL)
+    {
+        if(loop_profile_load(&prof, profile) != 0)
+        {
+            perror("Could not load profile");
+            exit(1);
+        }
+        state.prof = &prof;
+    }
+
+    state.mmu = NULL;
+    state.stats = NULL;
+    if(stats_name != NULL)
+    {
+        if(stats_open(&stats, stats_name, stats_interval) != 0)
+        {
+            perror(stats_name);
+            exit(1);
+        }
+        state.stats = &stats;
+    }
+
+    state.heat = NULL;
+    if(heat_rate > 0)
+    {
+        heat = (struct heatmap *)malloc(sizeof(struct heatmap));
+        heatmap_init(heat, heat_rate, heat_window);
+        state.heat = heat;
+    }
+
+    /* Run guest code assembled from the command line instead of the tests */
+    if(run.nfiles > 0)
+    {
+        run_asm_files(&state, &run);
+        return 0;
+    }
     
     print_quadratic_tests(&state); 
     print_sum_array_tests(&state);
     print_find_max_tests(&state);
     print_fib_iter_tests(&state);
     print_fib_rec_tests(&state);
+    print_stack_tests(&state);
+    print_mmu_tests(&state);
     print_str_len_tests(&state);    
+    print_assembler_tests(&state);
+    print_simd_tests(&state);
+    print_device_tests(&state, dev_base);
+    print_semihosting_tests(&state);
+    print_smp_tests(&state, ncores);
+
+    if(in.path != NULL)
+    {
+        if(map_input(&in) != 0)
+        {
+            perror("Could not map input file");
+            exit(1);
+        }
+        print_mapped_tests(&state, &in);
+        unmap_input(&in);
+    }
 
     return 0;
 }
@@ -0,0 +1,110 @@
+/* Live monitor for armemu -S: follows the statistics ring in shared
+ * memory and prints each new snapshot without stopping the emulator */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "armstat.h"
+
+/* Copy the snapshot in slot n, retrying while the writer is in it.
+ * Returns false if the writer has lapped the reader and reused it. The
+ * writer fills slot published % STATS_SLOTS before counting it, so only
+ * the last STATS_SLOTS - 1 published snapshots are safe to read. */
+bool read_snapshot(struct stats_ring *ring, unsigned long long n, struct stats_snapshot *snap)
+{
+    struct stats_slot *slot = &ring->slots[n % STATS_SLOTS];
+    unsigned int seq;
+
+    do
+    {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        *snap = slot->snap;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    while((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+
+    return __atomic_load_n(&ring->published, __ATOMIC_ACQUIRE) - n < STATS_SLOTS;
+}
+
+double percent(unsigned long long part, unsigned long long total)
+{
+    return total == 0 ? 0 : (double) part / total * 100;
+}
+
+void print_snapshot(struct stats_snapshot *snap)
+{
+    printf("%5llu %14llu %5.1f %5.1f %5.1f %6.1f %6.1f %5.2f %9.2f\n",
+           snap->run, snap->total_inst_count,
+           percent(snap->dp_inst_count, snap->total_inst_count),
+           percent(snap->mem_inst_count, snap->total_inst_count),
+           percent(snap->branch_inst_count, snap->total_inst_count),
+           percent(snap->branch_taken, snap->branch_taken + snap->branch_not_taken),
+           percent(snap->cache_misses, snap->cache_requests),
+           snap->total_inst_count == 0 ? 0 : (double) snap->cycles / snap->total_inst_count,
+           snap->mips);
+}
+
+int main(int argc, char **argv)
+{
+    struct stats_ring *ring;
+    struct stats_snapshot snap;
+    struct timespec period;
+    unsigned long long seen = 0, published;
+    int fd, ms = 500;
+
+    /* Usage: armstat /name [period_ms] */
+    if(argc < 2)
+    {
+        fprintf(stderr, "Usage: %s /name [period_ms]\n", argv[0]);
+        return 1;
+    }
+    if(argc >= 3)
+    {
+        ms = atoi(argv[2]);
+    }
+    period.tv_sec = ms / 1000;
+    period.tv_nsec = (ms % 1000) * 1000000L;
+
+    fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd < 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    ring = mmap(NULL, sizeof(struct stats_ring), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ring == MAP_FAILED || __atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC)
+    {
+        fprintf(stderr, "%s is not an armemu statistics ring\n", argv[1]);
+        return 1;
+    }
+
+    printf("  run   instructions    dp   mem   br  taken  cmiss   CPI      MIPS\n");
+
+    /* Print every snapshot still in the ring, then follow new ones */
+    while(true)
+    {
+        published = __atomic_load_n(&ring->published, __ATOMIC_ACQUIRE);
+        if(published < seen || published - seen >= STATS_SLOTS)
+        {
+            seen = published < STATS_SLOTS ? 0 : published - STATS_SLOTS + 1;
+        }
+        for(; seen < published; seen++)
+        {
+            if(read_snapshot(ring, seen, &snap))
+            {
+                print_snapshot(&snap);
+            }
+        }
+        fflush(stdout);
+        nanosleep(&period, NULL);
+    }
+
+    return 0;
+}
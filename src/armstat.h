@@ -0,0 +1,45 @@
+/* Live statistics shared between armemu -S and armstat through a POSIX
+ * shared memory object. armemu is the only writer. */
+
+#ifndef ARMSTAT_H
+#define ARMSTAT_H
+
+#define STATS_MAGIC 0x41524D53
+#define STATS_SLOTS 64
+
+/* Counters of the current run at one point in time */
+struct stats_snapshot
+{
+    unsigned long long run;
+    unsigned long long time_ns;
+    unsigned long long total_inst_count;
+    unsigned long long dp_inst_count;
+    unsigned long long mem_inst_count;
+    unsigned long long branch_inst_count;
+    unsigned long long branch_taken;
+    unsigned long long branch_not_taken;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long cache_requests;
+    unsigned long long cycles;
+    double mips;
+};
+
+/* seq is odd while the writer is filling the slot. A reader copies the
+ * snapshot and retries unless seq was even and unchanged around it. */
+struct stats_slot
+{
+    unsigned int seq;
+    struct stats_snapshot snap;
+};
+
+/* Snapshot n goes in slot n % STATS_SLOTS, published counts them */
+struct stats_ring
+{
+    unsigned int magic;
+    unsigned int nslots;
+    unsigned long long published;
+    struct stats_slot slots[STATS_SLOTS];
+};
+
+#endif
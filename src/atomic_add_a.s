@@ -0,0 +1,30 @@
+	.global atomic_add_a
+	.func atomic_add_a
+
+/* r0 - int *counter */
+/* r1 - int n */
+/* r2 - int i */
+/* r3 - int value */
+/* r12 - int strex status */
+atomic_add_a:
+	mov r2, #0
+loop:
+	cmp r2, r1
+	beq endloop
+
+retry:
+	//atomically increment the shared counter
+	ldrex r3, [r0]
+	add r3, r3, #1
+	strex r12, r3, [r0]
+	cmp r12, #0
+	bne retry
+
+	//increment counter
+	add r2, r2, #1
+	b loop
+endloop:
+	//publish the stores before returning
+	dmb
+	mov r0, #0
+	bx lr
@@ -0,0 +1,43 @@
+	.global find_max_v_a
+	.func find_max_v_a
+
+/* r0 - int* array */
+/* r1 - int n (multiple of 4, at least 4) */
+/* r2 - int i */
+/* q0 - int max[4] */
+find_max_v_a:
+	mov r2, #0
+	vld1.32 {d0, d1}, [r0]
+loop:
+	cmp r2, r1
+	beq endloop
+
+	//keep the larger of each lane
+	vld1.32 {d2, d3}, [r0]!
+	vmax.s32 q0, q0, q1
+
+	//increment values
+	add r2, r2, #4
+	b loop
+endloop:
+	//reduce the four lanes to one max
+	sub sp, sp, #16
+	vst1.32 {d0, d1}, [sp]
+	ldr r0, [sp]
+	ldr r1, [sp, #4]
+	cmp r0, r1
+	bgt max1
+	mov r0, r1
+max1:
+	ldr r1, [sp, #8]
+	cmp r0, r1
+	bgt max2
+	mov r0, r1
+max2:
+	ldr r1, [sp, #12]
+	cmp r0, r1
+	bgt max3
+	mov r0, r1
+max3:
+	add sp, sp, #16
+	bx lr
@@ -0,0 +1,49 @@
+/* The assembly functions linked into analyze and armemu, in one table so
+ * both programs accept the same names */
+
+#ifndef FUNCTIONS_H
+#define FUNCTIONS_H
+
+int addsub_a(int a, int b);
+int quadratic_a(int x, int a, int b, int c);
+int sum_array_a(int *array, int n);
+int find_max_a(int *array, int n);
+int fib_iter_a(int n);
+int fib_rec_a(int n);
+int strlen_a(char* a);
+int atomic_add_a(int *counter, int n);
+int sum_array_v_a(int *array, int n);
+int find_max_v_a(int *array, int n);
+void quadratic_f_a(float *result, float *args);
+int uart_puts_a(char *s, unsigned int *uart);
+int timer_wait_a(unsigned int *devices, int ticks);
+int semihost_puts_a(int handle, char *s, int len, int n);
+
+/* Functions that can be named on the command line or in a profile */
+struct function
+{
+    char *name;
+    void *addr;
+};
+
+static struct function functions[] =
+{
+    {"addsub_a", addsub_a},
+    {"quadratic_a", quadratic_a},
+    {"sum_array_a", sum_array_a},
+    {"find_max_a", find_max_a},
+    {"fib_iter_a", fib_iter_a},
+    {"fib_rec_a", fib_rec_a},
+    {"strlen_a", strlen_a},
+    {"atomic_add_a", atomic_add_a},
+    {"sum_array_v_a", sum_array_v_a},
+    {"find_max_v_a", find_max_v_a},
+    {"quadratic_f_a", quadratic_f_a},
+    {"uart_puts_a", uart_puts_a},
+    {"timer_wait_a", timer_wait_a},
+    {"semihost_puts_a", semihost_puts_a}
+};
+
+#define NUM_FUNCTIONS ((int) (sizeof(functions) / sizeof(functions[0])))
+
+#endif
@@ -0,0 +1,19 @@
+	.global quadratic_f_a
+	.func quadratic_f_a
+
+/* r0 - float *result */
+/* r1 - float args[4] (x, a, b, c) */
+quadratic_f_a:
+	vldr s0, [r1]
+	vldr s1, [r1, #4]
+	vldr s2, [r1, #8]
+	vldr s3, [r1, #12]
+
+	//a * x * x + b * x + c
+	vmul.f32 s4, s0, s0
+	vmul.f32 s4, s4, s1
+	vmla.f32 s4, s0, s2
+	vadd.f32 s4, s4, s3
+
+	vstr s4, [r0]
+	bx lr
@@ -0,0 +1,34 @@
+	.global semihost_puts_a
+	.func semihost_puts_a
+
+/* r0 - int handle */
+/* r1 - char *s */
+/* r2 - int len */
+/* r3 - int n */
+/* r12 - int i */
+semihost_puts_a:
+	//build the SYS_WRITE parameter block: handle, buffer, length
+	sub sp, sp, #16
+	str r0, [sp]
+	str r1, [sp, #4]
+	str r2, [sp, #8]
+
+	mov r12, #0
+loop:
+	cmp r12, r3
+	beq endloop
+
+	//SYS_WRITE
+	mov r0, #5
+	mov r1, sp
+	svc 0x123456
+
+	add r12, r12, #1
+	b loop
+endloop:
+	//SYS_CLOCK
+	mov r0, #16
+	svc 0x123456
+
+	add sp, sp, #16
+	bx lr
@@ -0,0 +1,35 @@
+	.global sum_array_v_a
+	.func sum_array_v_a
+
+/* r0 - int* array */
+/* r1 - int n (multiple of 4) */
+/* r2 - int i */
+/* q1 - int total[4] */
+sum_array_v_a:
+	mov r2, #0
+	vdup.32 q1, r2
+loop:
+	//loop check
+	cmp r2, r1
+	beq endloop
+
+	//add the next four elements to the partial sums
+	vld1.32 {d0, d1}, [r0]!
+	vadd.i32 q1, q1, q0
+
+	//increment variables
+	add r2, r2, #4
+	b loop
+endloop:
+	//add up the four partial sums
+	sub sp, sp, #16
+	vst1.32 {d2, d3}, [sp]
+	ldr r0, [sp]
+	ldr r1, [sp, #4]
+	add r0, r0, r1
+	ldr r1, [sp, #8]
+	add r0, r0, r1
+	ldr r1, [sp, #12]
+	add r0, r0, r1
+	add sp, sp, #16
+	bx lr
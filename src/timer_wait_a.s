@@ -0,0 +1,28 @@
+	.global timer_wait_a
+	.func timer_wait_a
+
+/* r0 - unsigned int *devices (uart +0x000, timer +0x100, intc +0x200) */
+/* r1 - int ticks */
+/* r2 - int polls */
+/* r3 - scratch */
+timer_wait_a:
+	//enable the timer interrupt line
+	mov r3, #1
+	str r3, [r0, #0x208]
+
+	//start a one-shot countdown
+	str r1, [r0, #0x100]
+	str r3, [r0, #0x108]
+
+	mov r2, #0
+poll:
+	//wait for the interrupt to become pending
+	add r2, r2, #1
+	ldr r3, [r0, #0x200]
+	cmp r3, #0
+	beq poll
+
+	//acknowledge it
+	str r3, [r0, #0x20c]
+	mov r0, r2
+	bx lr
@@ -0,0 +1,26 @@
+	.global uart_puts_a
+	.func uart_puts_a
+
+/* r0 - char *s */
+/* r1 - unsigned int *uart */
+/* r2 - int i */
+uart_puts_a:
+	mov r2, #0
+while:
+	// load the next character into r12
+	ldrb r12, [r0]
+
+	// stop at the end of the string
+	cmp r12, #0
+	beq endloop
+
+	// write the character to the uart data register
+	str r12, [r1]
+
+	// increment index and count
+	add r0, r0, #1
+	add r2, r2, #1
+	b while
+endloop:
+	mov r0, r2
+	bx lr